@@ -1,8 +1,184 @@
 #include "provided.h"
+#include "RouterApi.h"
+#include "HilbertCurve.h"
+#include "StreetGraph.h"
+#include "MemoryAccounting.h"
+#include "ParallelFor.h"
+#include "StageTiming.h"
 #include <vector>
 #include <random>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <memory_resource>
 using namespace std;
 
+//Schedule of a run of consecutive stops, summarised so that two runs can be joined in O(1) (the time window segments
+//of Vidal et al.). Arriving after a window closes counts as travelling back in time to the window's end, and the total
+//of those jumps is the time warp. That keeps every order's schedule well defined, so orders that miss windows can be
+//compared by how much they miss them by.
+struct TimeSegment {
+  int first = -1; //First and last point of the run, -1 for a run with no points
+  int last = -1;
+  double duration = 0; //Minutes of travel, service and waiting from starting the first visit to finishing the last
+  double time_warp = 0;
+  double earliest = 0; //Window for starting the first visit without waiting or time warp later in the run
+  double latest = 0;
+};
+
+//Leg costs for the stops of one path: indices below n are the stops, n is where the path starts and n + 1 is where
+//it ends. Every leg starts out costed at its crow distance and can be switched over to its road distance once that
+//has been routed. Road distances can differ by direction, so legs are directed.
+struct PathCosts {
+  int n;
+  pmr::vector<GeoCoord> points;
+  pmr::vector<double> cost;
+  pmr::vector<bool> on_road; //Whether a leg's cost is its road distance
+  bool has_windows = false; //Whether any stop has a time window, the schedule is only tracked if one does
+  double minutes_per_mile = 0;
+  pmr::vector<TimeSegment> visit; //Point -> the run made of just that point
+
+  //schedules is either empty or has one entry per stop
+  PathCosts(const GeoCoord &from, const GeoCoord &to, const vector<DeliveryRequest> &stops,
+			const vector<StopSchedule> &schedules = {}, double milesPerHour = 0)
+	  : n{(int) stops.size()}, points(requestMemory()), cost(requestMemory()), on_road(requestMemory()), visit(requestMemory()) {
+	for (int i = 0; i < n; i++) {
+	  StopSchedule stop = schedules.empty() ? StopSchedule() : schedules[i];
+	  points.push_back(stops[i].location);
+	  visit.push_back({i, i, stop.serviceMinutes, 0, stop.windowStart, stop.windowEnd});
+	  has_windows |= milesPerHour > 0 && stop.hasTimeWindow();
+	}
+	points.push_back(from);
+	points.push_back(to);
+	visit.push_back({n, n, 0, 0, 0, numeric_limits<double>::infinity()}); //The path can start any time from 0
+	visit.push_back({n + 1, n + 1, 0, 0, 0, numeric_limits<double>::infinity()});
+	if (has_windows) {
+	  minutes_per_mile = 60 / milesPerHour;
+	}
+	cost.resize((n + 2) * (n + 2));
+	on_road.resize((n + 2) * (n + 2), false);
+	for (int a = 0; a < n + 2; a++) {
+	  for (int b = 0; b < n + 2; b++) {
+		cost[a * (n + 2) + b] = distanceEarthMiles(points[a], points[b]);
+	  }
+	}
+  }
+
+  double operator()(int a, int b) const {
+	return cost[a * (n + 2) + b];
+  }
+
+  bool onRoad(const vector<int> &order) const { //Whether every leg of the path has been routed
+	int last = n;
+	for (int stop : order) {
+	  if (!on_road[last * (n + 2) + stop]) {
+		return false;
+	  }
+	  last = stop;
+	}
+	return on_road[last * (n + 2) + n + 1];
+  }
+
+  double pathLength(const vector<int> &order) const { //From the start, through the stops in order, to the end
+	double total = 0;
+	int last = n;
+	for (int stop : order) {
+	  total += (*this)(last, stop);
+	  last = stop;
+	}
+	return total + (*this)(last, n + 1);
+  }
+
+  TimeSegment join(const TimeSegment &a, const TimeSegment &b) const { //The run a followed by the run b
+	if (a.first == -1 || b.first == -1) {
+	  return a.first == -1 ? b : a;
+	}
+	double travel = (*this)(a.last, b.first) * minutes_per_mile;
+	double shift = a.duration - a.time_warp + travel; //From starting a to reaching b
+	double wait = max(b.earliest - shift - a.latest, 0.0);
+	double warp = max(a.earliest + shift - b.latest, 0.0);
+	return {a.first, b.last,
+			a.duration + b.duration + travel + wait,
+			a.time_warp + b.time_warp + warp,
+			max(b.earliest - shift, a.earliest) - wait,
+			min(b.latest - shift, a.latest) + warp};
+  }
+
+  double objective(const vector<int> &order, double penalty) const { //Path length plus penalty miles per minute late
+	return pathLength(order) + (has_windows ? penalty * timeWarp(order) : 0);
+  }
+
+  double timeWarp(const vector<int> &order) const { //Minutes of lateness summed over the stops of the path
+	if (!has_windows) {
+	  return 0;
+	}
+	TimeSegment path = visit[n];
+	for (int stop : order) {
+	  path = join(path, visit[stop]);
+	}
+	return join(path, visit[n + 1]).time_warp;
+  }
+};
+
+//Segment tree over the schedule of a path: leaf i is the visit at position i of start, stops in order, end. Any run of
+//consecutive positions can be summarised in O(log n), which is what lets a swap be checked against the time windows
+//without simulating the whole path again.
+class ScheduleTree {
+ public:
+  ScheduleTree(const PathCosts &costs, const vector<int> &order) : costs{costs}, size{1}, tree(requestMemory()) {
+	while (size < costs.n + 2) {
+	  size *= 2;
+	}
+	tree.resize(2 * size);
+	tree[size] = costs.visit[costs.n];
+	for (int i = 0; i < costs.n; i++) {
+	  tree[size + i + 1] = costs.visit[order[i]];
+	}
+	tree[size + costs.n + 1] = costs.visit[costs.n + 1];
+	for (int i = size - 1; i > 0; i--) {
+	  tree[i] = costs.join(tree[2 * i], tree[2 * i + 1]);
+	}
+  }
+
+  void set(int position, int point) {
+	int i = size + position;
+	tree[i] = costs.visit[point];
+	for (i /= 2; i > 0; i /= 2) {
+	  tree[i] = costs.join(tree[2 * i], tree[2 * i + 1]);
+	}
+  }
+
+  TimeSegment range(int begin, int end) const { //Positions begin .. end - 1
+	TimeSegment left, right;
+	for (begin += size, end += size; begin < end; begin /= 2, end /= 2) {
+	  if (begin & 1) {
+		left = costs.join(left, tree[begin++]);
+	  }
+	  if (end & 1) {
+		right = costs.join(tree[--end], right);
+	  }
+	}
+	return costs.join(left, right);
+  }
+
+  double whole() const {
+	return tree[1].time_warp;
+  }
+
+  double swappedTimeWarp(const vector<int> &order, int a, int b) const { //After swapping the stops at order positions a < b
+	TimeSegment path = costs.join(range(0, a + 1), costs.visit[order[b]]);
+	path = costs.join(path, range(a + 2, b + 1));
+	path = costs.join(path, costs.visit[order[a]]);
+	return costs.join(path, range(b + 2, costs.n + 2)).time_warp;
+  }
+
+ private:
+  const PathCosts &costs;
+  int size;
+  pmr::vector<TimeSegment> tree;
+};
+
 class DeliveryOptimizerImpl {
  public:
   DeliveryOptimizerImpl(const StreetMap *sm);
@@ -12,110 +188,633 @@ class DeliveryOptimizerImpl {
 	  vector<DeliveryRequest> &deliveries,
 	  double &oldCrowDistance,
 	  double &newCrowDistance) const;
+  void optimizeDeliveryOrder(
+	  const MapSnapshot &snap,
+	  const GeoCoord &depot,
+	  vector<DeliveryRequest> &deliveries,
+	  vector<StopSchedule> &schedules,
+	  double &oldCrowDistance,
+	  double &newCrowDistance,
+	  bool &distancesExact,
+	  const PlanOptions &options) const;
 
  private:
-  PointToPointRouter router;
-  double getActualCrowDist(const GeoCoord &depot, const vector<DeliveryRequest> &deliveries) const;
-  double getApproxCrowDist(const GeoCoord &depot, const vector<DeliveryRequest> &deliveries) const;
-  void randomlySwapDeliveries(vector<DeliveryRequest> &vec, int a, int b) const;
-  pair<int, int> randomlySwapDeliveries(vector<DeliveryRequest> &vec) const;
-  int randInt(int min, int max) const;
+  static constexpr size_t kDecomposeAbove = 150; //Manifests larger than this are split into geographic clusters
+  static constexpr size_t kClusterSize = 60; //Target number of stops in one cluster's sub-tour
+  static constexpr size_t kJointWindow = 6; //Stops on each side of a cluster boundary that get re-optimized after stitching
+  static constexpr long kMovesPerStop = 2000; //Annealing moves per stop when there's no deadline
+  static constexpr long kMinMoves = 10000;
+  static constexpr long kPlateauPerStop = 500; //Moves per stop without a new best before the search counts as converged
+  static constexpr long kMinPlateau = 5000;
+  static constexpr int kExactMaxStops = 16; //Largest path the Held-Karp table is built for, it needs 2^n * n doubles
+  static constexpr int kBranchAndBoundMaxStops = 40; //Beyond this the bound prunes too little to be worth running
+  static constexpr long kRelaxationsPerMove = 14; //Measured cost of one annealing move in Held-Karp table relaxations
+  static constexpr double kRelaxationSeconds = 5e-9; //Measured time of one Held-Karp relaxation, used against deadlines
+  static constexpr double kLatenessPenalty = 100; //Miles a minute of missed time window is worth, high enough that being on time comes first
+  static constexpr double kNoRoutePenalty = 1e6; //Miles a leg without a route is costed at, finite so path lengths still add and subtract
+  using Deadline = chrono::steady_clock::time_point;
+
+  const StreetMap *map;
+  void orderStops(const GeoCoord &from, const GeoCoord &to, vector<DeliveryRequest> &stops, mt19937 &gen, Deadline deadline) const;
+  void orderOnRoads(const MapSnapshot &snap, PathCosts &costs, vector<int> &order, mt19937 &gen, Deadline deadline) const;
+  int routeLegs(const MapSnapshot &snap, PathCosts &costs, const vector<int> &order, Deadline deadline = Deadline::max()) const;
+  void orderPath(const PathCosts &costs, vector<int> &order, mt19937 &gen, Deadline deadline) const;
+  void annealPath(const PathCosts &costs, vector<int> &order, mt19937 &gen, Deadline deadline) const;
+  void heldKarpPath(const PathCosts &costs, vector<int> &order) const;
+  void branchAndBoundPath(const PathCosts &costs, vector<int> &order, Deadline deadline) const;
+  void optimizeByClusters(const GeoCoord &depot, vector<DeliveryRequest> &deliveries, mt19937 &gen, Deadline deadline) const;
+  double crowLength(const GeoCoord &depot, const vector<DeliveryRequest> &deliveries) const;
+  double roadLength(const MapSnapshot &snap, const GeoCoord &depot, const vector<DeliveryRequest> &deliveries, Deadline deadline, bool &exact) const;
+  pair<int, int> pickSwap(int n, mt19937 &gen) const;
+  double swapDelta(const PathCosts &costs, const vector<int> &order, int a, int b) const;
+  int randInt(int min, int max, mt19937 &gen) const;
 };
 
-DeliveryOptimizerImpl::DeliveryOptimizerImpl(const StreetMap *sm) : router{sm} {
+DeliveryOptimizerImpl::DeliveryOptimizerImpl(const StreetMap *sm) : map{sm} {
 
 }
 
 DeliveryOptimizerImpl::~DeliveryOptimizerImpl() {
 }
 
-void DeliveryOptimizerImpl::randomlySwapDeliveries(vector<DeliveryRequest> &vec, int a, int b) const {
-  swap(vec[a], vec[b]); //Swaps item in vector
-}
-
-pair<int, int> DeliveryOptimizerImpl::randomlySwapDeliveries(vector<DeliveryRequest> &vec) const {
+pair<int, int> DeliveryOptimizerImpl::pickSwap(int n, mt19937 &gen) const {
   int a = 0;
   int b = 0;
   while (a == b) { //Make sure we don't swap the same two items
-	a = randInt(0, vec.size() - 1);
-	b = randInt(0, vec.size() - 1);
+	a = randInt(0, n - 1, gen);
+	b = randInt(0, n - 1, gen);
   }
-  randomlySwapDeliveries(vec, a, b);
   return {a, b};
 }
 
 void DeliveryOptimizerImpl::optimizeDeliveryOrder(const GeoCoord &depot, vector<DeliveryRequest> &deliveries, double &oldCrowDistance, double &newCrowDistance) const {
-  oldCrowDistance = getActualCrowDist(depot, deliveries); //Calculate the total distance without optimization
+  shared_ptr<const MapSnapshot> snap = mapSnapshot(*map); //Every leg is measured on the same version of the map
+  if (snap == nullptr) {
+	oldCrowDistance = newCrowDistance = 0;
+	return;
+  }
+  vector<StopSchedule> schedules;
+  bool exact;
+  optimizeDeliveryOrder(*snap, depot, deliveries, schedules, oldCrowDistance, newCrowDistance, exact, PlanOptions());
+}
 
-  double t = sqrt(deliveries.size()); //Variable Start Temperature
-  double cooling_rate = 0.995;
-  double best_dist = getApproxCrowDist(depot, deliveries);
-  vector<DeliveryRequest> currentSolution = deliveries;
+void DeliveryOptimizerImpl::optimizeDeliveryOrder(const MapSnapshot &snap, const GeoCoord &depot, vector<DeliveryRequest> &deliveries, vector<StopSchedule> &schedules, double &oldCrowDistance, double &newCrowDistance, bool &distancesExact, const PlanOptions &options) const {
+  MemoryScope scope(MEM_OPTIMIZER);
+  StageTimer stage(STAGE_OPTIMIZE);
+  RequestArena arena; //Cost tables, search state and every leg's routing are released together when we're done
+  auto started = chrono::steady_clock::now();
+  Deadline deadline = Deadline::max();
+  auto budget = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(options.timeBudgetSeconds));
   std::random_device rd;
   std::mt19937 gen(rd());
-  std::uniform_real_distribution<> dis(0.0, 1.0);
-  for (int i = 0; i < 10000; i++) { //Run for 10,000 iterations
-	if (t > 1e-8) {
-	  pair<int, int> swapped = randomlySwapDeliveries(currentSolution); //Randomly swap pairs of delivery locations
-	  double cur_dist = getApproxCrowDist(depot, currentSolution);
-	  if (cur_dist < best_dist) {
-		best_dist = cur_dist; //This iteration is better, record the best distance
-	  } else if (exp((best_dist - cur_dist) / t) < dis(gen)) { //If it's worse, swap back to what we had before
-		randomlySwapDeliveries(currentSolution, swapped.second, swapped.first);
-	  }
-	  t *= cooling_rate;
+
+  bool windows = any_of(schedules.begin(), schedules.end(), [](const StopSchedule &s) { return s.hasTimeWindow(); });
+  if (options.timeBudgetSeconds > 0) {
+	deadline = started + budget;
+  }
+  //Too many stops to order as one tour, this works on crow distances. Both tours are then measured on the road with
+  //the time that's left (all of it without a deadline) and compared there if that finished, or on crow distances if
+  //not. Clusters follow the map rather than the clock, so a manifest with time windows is always ordered as one tour.
+  if (deliveries.size() > kDecomposeAbove && !windows) {
+	vector<DeliveryRequest> currentSolution = deliveries;
+	optimizeByClusters(depot, currentSolution, gen, deadline);
+	bool old_exact = true;
+	bool new_exact = true;
+	oldCrowDistance = roadLength(snap, depot, deliveries, deadline, old_exact); //Calculate the total distance without optimization
+	newCrowDistance = roadLength(snap, depot, currentSolution, deadline, new_exact); //Calculate our final distance traveled
+	bool shorter = old_exact && new_exact ? newCrowDistance < oldCrowDistance
+										  : crowLength(depot, currentSolution) < crowLength(depot, deliveries);
+	if (shorter) { //If our optimization actually made things worse, just ignore it and stick with what we had. This should rarely happen.
+	  deliveries = currentSolution;
+	  distancesExact = old_exact && new_exact;
 	} else {
-	  break;
+	  newCrowDistance = oldCrowDistance;
+	  distancesExact = old_exact;
 	}
+	return;
   }
 
-  newCrowDistance = getActualCrowDist(depot, currentSolution); //Calculate our final distance traveled
-  if (newCrowDistance < oldCrowDistance) { //If our optimization actually made things worse, just ignore it and stick with what we had. This should rarely happen.
-	deliveries = currentSolution;
+  PathCosts costs(depot, depot, deliveries, schedules, options.milesPerHour);
+  vector<int> order;
+  for (int i = 0; i < costs.n; i++) {
+	order.push_back(i);
+  }
+  vector<int> original = order;
+  orderOnRoads(snap, costs, order, gen, deadline);
+  //Whatever time is left scores the original order on the road. With both orders routed the comparison is exact,
+  //lateness included. Otherwise the new order stands: it was first ordered on crow distances starting from the
+  //original, which keeps the original unless it finds something shorter.
+  routeLegs(snap, costs, original, deadline);
+  oldCrowDistance = costs.pathLength(original); //Road distance where routed, crow distance elsewhere
+  bool exact = costs.onRoad(order) && costs.onRoad(original);
+  distancesExact = costs.onRoad(original);
+  if (order != original && (!exact || costs.objective(order, kLatenessPenalty) < costs.objective(original, kLatenessPenalty))) {
+	newCrowDistance = costs.pathLength(order);
+	distancesExact = exact;
+	vector<DeliveryRequest> ordered;
+	vector<StopSchedule> ordered_schedules;
+	for (int i : order) {
+	  ordered.push_back(deliveries[i]);
+	  if (!schedules.empty()) {
+		ordered_schedules.push_back(schedules[i]);
+	  }
+	}
+	deliveries = ordered;
+	schedules = ordered_schedules;
   } else {
 	newCrowDistance = oldCrowDistance;
   }
 }
 
-//Generates the actual routes using PointToPointRouter and returns the exact distance
-double DeliveryOptimizerImpl::getActualCrowDist(const GeoCoord &depot, const vector<DeliveryRequest> &deliveries) const {
-  double temp_distance = 0;
-  double total_dist = 0;
-  list<StreetSegment> temp;
-  router.generatePointToPointRoute(depot, deliveries[0].location, temp, temp_distance);
-  total_dist += temp_distance;
+//Orders stops on crow distances, for callers that only have an approximate path to work with
+void DeliveryOptimizerImpl::orderStops(const GeoCoord &from, const GeoCoord &to, vector<DeliveryRequest> &stops, mt19937 &gen, Deadline deadline) const {
+  PathCosts costs(from, to, stops);
+  vector<int> order;
+  for (int i = 0; i < costs.n; i++) {
+	order.push_back(i);
+  }
+  orderPath(costs, order, gen, deadline);
+  vector<DeliveryRequest> ordered;
+  for (int i : order) {
+	ordered.push_back(stops[i]);
+  }
+  stops = ordered;
+}
 
-  for (int i = 0; i < deliveries.size() - 1; i++) {
-	router.generatePointToPointRoute(deliveries[i].location, deliveries[i + 1].location, temp, temp_distance);
-	total_dist += temp_distance;
+//Orders the path on road distances without routing every pair of stops. A leg that hasn't been routed is costed at
+//its crow distance, which is never more than its road distance. The first round orders the path on crow distances
+//alone, and each round routes the legs of its order that are still estimates and then orders again on the updated
+//costs. When a round has nothing left to route, its order was chosen with its own legs exact and every other leg
+//underestimated, so no other order can be shorter on the road if orderPath was exact. Rounds go on until then or the
+//deadline, every round but the last routes at least one more leg so they always end. Leaves the fully routed order
+//with the lowest objective (road length plus any lateness penalty) in order, or the first round's order if the
+//deadline came before any was routed.
+void DeliveryOptimizerImpl::orderOnRoads(const MapSnapshot &snap, PathCosts &costs, vector<int> &order, mt19937 &gen, Deadline deadline) const {
+  double best_cost = numeric_limits<double>::infinity();
+  for (int round = 0;; round++) {
+	vector<int> candidate = order;
+	orderPath(costs, candidate, gen, deadline);
+	int routed = routeLegs(snap, costs, candidate, deadline);
+	if (!costs.onRoad(candidate)) { //Out of time, only the crow distance order is worth keeping over a routed one
+	  if (round == 0) {
+		order = candidate;
+	  }
+	  return;
+	}
+	double cost = costs.objective(candidate, kLatenessPenalty);
+	if (cost < best_cost) {
+	  best_cost = cost;
+	  order = candidate;
+	}
+	if (routed == 0 || chrono::steady_clock::now() >= deadline) {
+	  return;
+	}
   }
+}
 
-  router.generatePointToPointRoute(deliveries[deliveries.size() - 1].location, depot, temp, temp_distance);
-  total_dist += temp_distance;
+//Routes every leg of the path in order that is still costed by crow distance and records its road distance, until
+//the deadline. When the map's weights are symmetric the route back costs the same, so the reverse leg is recorded
+//too. Returns how many legs it routed. A leg without a route costs kNoRoutePenalty, so orders that avoid it come first.
+int DeliveryOptimizerImpl::routeLegs(const MapSnapshot &snap, PathCosts &costs, const vector<int> &order, Deadline deadline) const {
+  int routed = 0;
+  list<StreetSegment> route;
+  int last = costs.n;
+  for (size_t i = 0; i <= order.size(); i++) {
+	int next = i == order.size() ? costs.n + 1 : order[i];
+	int leg = last * (costs.n + 2) + next;
+	if (!costs.on_road[leg]) {
+	  if (deadline != Deadline::max() && chrono::steady_clock::now() >= deadline) {
+		break;
+	  }
+	  double dist = 0;
+	  int back = next * (costs.n + 2) + last;
+	  if (generatePointToPointRoute(snap, costs.points[last], costs.points[next], route, dist) != DELIVERY_SUCCESS) {
+		dist = kNoRoutePenalty;
+	  }
+	  costs.cost[leg] = dist;
+	  costs.on_road[leg] = true;
+	  if (snap.metric->symmetric) {
+		costs.cost[back] = dist;
+		costs.on_road[back] = true;
+	  }
+	  routed++;
+	}
+	last = next;
+  }
+  return routed;
+}
 
-  return total_dist;
+//Picks how to order the stops on a path. Held-Karp gives the optimal order and is used whenever building its table is
+//cheaper than the alternative (and fits before the deadline). The alternative is to anneal, and for paths that are
+//still small enough for a bounded search to prune well, spend up to as long again on branch-and-bound seeded with the
+//annealed order. Neither exact search knows about time windows, so paths with windows are only annealed.
+void DeliveryOptimizerImpl::orderPath(const PathCosts &costs, vector<int> &order, mt19937 &gen, Deadline deadline) const {
+  int n = order.size();
+  if (n < 2) {
+	return;
+  }
+  if (costs.has_windows) {
+	annealPath(costs, order, gen, deadline);
+	return;
+  }
+  if (n <= kExactMaxStops) {
+	double relaxations = ldexp((double) n * (n - 1), n - 2); //Every subset relaxes each of its stops from each other one
+	double moves = max<long>(kMinMoves, kMovesPerStop * n) * (n <= kBranchAndBoundMaxStops ? 2 : 1);
+	double remaining = chrono::duration<double>(deadline - chrono::steady_clock::now()).count();
+	if (relaxations <= kRelaxationsPerMove * moves && relaxations * kRelaxationSeconds < remaining) {
+	  heldKarpPath(costs, order);
+	  return;
+	}
+  }
+  auto started = chrono::steady_clock::now();
+  annealPath(costs, order, gen, deadline);
+  if (n <= kBranchAndBoundMaxStops) {
+	auto now = chrono::steady_clock::now();
+	branchAndBoundPath(costs, order, deadline - now > now - started ? now + (now - started) : deadline);
+  }
 }
 
-//Approximate the distance of a route by summing the 'euclidean' distance between the delivery points/depot.
-//This is much faster than generating the entire route and is generally a good approximation for the total distance the routes will take
-double DeliveryOptimizerImpl::getApproxCrowDist(const GeoCoord &depot, const vector<DeliveryRequest> &deliveries) const {
-  double total_approx_dist = 0;
-  total_approx_dist += distanceEarthMiles(depot, deliveries[0].location);
+//Exact shortest path from the start through every stop to the end by dynamic programming over subsets.
+//cost[mask * n + j] is the shortest path from the start that visits exactly the stops in mask and ends at stop j, so
+//the entries a subset reads (one per stop, for one smaller subset) are contiguous. Subsets with the same number of
+//stops only depend on smaller ones, so each layer is filled in parallel.
+void DeliveryOptimizerImpl::heldKarpPath(const PathCosts &costs, vector<int> &order) const {
+  int n = costs.n;
+  pmr::vector<double> into(n * n, requestMemory()); //into[j * n + i] is the cost from stop i to stop j, so relaxing j reads a contiguous row
+  for (int i = 0; i < n; i++) {
+	for (int j = 0; j < n; j++) {
+	  into[j * n + i] = costs(i, j);
+	}
+  }
+  pmr::vector<pmr::vector<uint32_t>> layers(n + 1, requestMemory()); //Subsets grouped by their number of stops
+  for (uint32_t mask = 1; mask < (1u << n); mask++) {
+	layers[__builtin_popcount(mask)].push_back(mask);
+  }
+
+  pmr::vector<double> cost((size_t) n << n, requestMemory());
+  for (int j = 0; j < n; j++) {
+	cost[((size_t) 1 << j) * n + j] = costs(n, j);
+  }
+  for (int k = 2; k <= n; k++) {
+	const pmr::vector<uint32_t> &layer = layers[k];
+	parallelFor(layer.size(), [&](size_t begin, size_t end) {
+	  for (size_t m = begin; m < end; m++) {
+		uint32_t mask = layer[m];
+		for (uint32_t js = mask; js != 0; js &= js - 1) {
+		  int j = __builtin_ctz(js);
+		  uint32_t prev = mask ^ (1u << j);
+		  const double *prev_cost = &cost[(size_t) prev * n];
+		  const double *to_j = &into[j * n];
+		  double best = numeric_limits<double>::infinity();
+		  for (uint32_t is = prev; is != 0; is &= is - 1) {
+			int i = __builtin_ctz(is);
+			best = min(best, prev_cost[i] + to_j[i]);
+		  }
+		  cost[(size_t) mask * n + j] = best;
+		}
+	  }
+	}, 256);
+  }
+
+  uint32_t mask = (1u << n) - 1; //Walk back from the best last stop, finding the predecessor each entry came from
+  int last = 0;
+  for (int j = 1; j < n; j++) {
+	if (cost[(size_t) mask * n + j] + costs(j, n + 1) < cost[(size_t) mask * n + last] + costs(last, n + 1)) {
+	  last = j;
+	}
+  }
+  order.clear();
+  while (true) {
+	order.push_back(last);
+	uint32_t prev = mask ^ (1u << last);
+	if (prev == 0) {
+	  break;
+	}
+	int pred = -1;
+	for (uint32_t is = prev; is != 0; is &= is - 1) {
+	  int i = __builtin_ctz(is);
+	  if (pred == -1 || cost[(size_t) prev * n + i] + into[last * n + i] < cost[(size_t) prev * n + pred] + into[last * n + pred]) {
+		pred = i;
+	  }
+	}
+	mask = prev;
+	last = pred;
+  }
+  reverse(order.begin(), order.end());
+}
+
+//Depth-first branch-and-bound over path orders, starting from the given order as the best known. A partial path is
+//dropped when its length plus a lower bound for the rest (every stop still to leave must take at least its cheapest
+//leg to a stop not yet visited or to the end) can't beat the best. Children are tried nearest first. Stops at the
+//deadline and leaves the best order found in order.
+void DeliveryOptimizerImpl::branchAndBoundPath(const PathCosts &costs, vector<int> &order, Deadline deadline) const {
+  int n = costs.n;
+  if (n < 2 || n > 64 || chrono::steady_clock::now() >= deadline) {
+	return;
+  }
+  pmr::vector<pmr::vector<int>> nearest(n + 1, requestMemory()); //Stops ordered by cost from each stop and from the start
+  for (int u = 0; u <= n; u++) {
+	for (int v = 0; v < n; v++) {
+	  if (v != u) {
+		nearest[u].push_back(v);
+	  }
+	}
+	sort(nearest[u].begin(), nearest[u].end(), [&](int a, int b) { return costs(u, a) < costs(u, b); });
+  }
+  auto bound = [&](uint64_t visited, int last) {
+	double total = 0;
+	for (int x = -1; x < n; x++) {
+	  int u = x == -1 ? last : x;
+	  if (x != -1 && (visited >> x & 1)) {
+		continue;
+	  }
+	  double cheapest = costs(u, n + 1);
+	  for (int v = 0; v < n; v++) {
+		if (v != u && !(visited >> v & 1)) {
+		  cheapest = min(cheapest, costs(u, v));
+		}
+	  }
+	  total += cheapest;
+	}
+	return total;
+  };
 
-  for (int i = 0; i < deliveries.size() - 1; i++) {
-	total_approx_dist += distanceEarthMiles(deliveries[i].location, deliveries[i + 1].location);
+  double best_dist = costs.pathLength(order);
+  pmr::vector<int> path(n, requestMemory());
+  pmr::vector<size_t> tried(n + 1, 0, requestMemory()); //Next candidate in nearest[] to try at each depth
+  pmr::vector<double> length(n + 1, 0, requestMemory()); //Length of the path up to each depth
+  uint64_t visited = 0;
+  int depth = 0;
+  long expanded = 0;
+  while (depth >= 0) {
+	if (++expanded % 1024 == 0 && chrono::steady_clock::now() >= deadline) {
+	  break;
+	}
+	int u = depth == 0 ? n : path[depth - 1];
+	if (depth == n) { //Every stop is placed, finish at the end
+	  double total = length[depth] + costs(u, n + 1);
+	  if (total < best_dist - 1e-12) {
+		best_dist = total;
+		order.assign(path.begin(), path.end());
+	  }
+	} else {
+	  const pmr::vector<int> &candidates = nearest[u];
+	  while (tried[depth] < candidates.size() && (visited >> candidates[tried[depth]] & 1)) {
+		tried[depth]++;
+	  }
+	  if (tried[depth] < candidates.size()) {
+		int v = candidates[tried[depth]++];
+		double len = length[depth] + costs(u, v);
+		if (len + bound(visited | (1ull << v), v) < best_dist - 1e-12) {
+		  path[depth] = v;
+		  visited |= 1ull << v;
+		  length[depth + 1] = len;
+		  tried[++depth] = 0;
+		}
+		continue;
+	  }
+	}
+	if (--depth >= 0) { //Done with this node, go back to its parent
+	  visited &= ~(1ull << path[depth]);
+	}
   }
-  total_approx_dist += distanceEarthMiles(deliveries[deliveries.size() - 1].location, depot);
-  return total_approx_dist;
 }
 
-int DeliveryOptimizerImpl::randInt(int min, int max) const { //From Project 3 provided.h
+//Simulated annealing over the order of stops on a path. The start temperature is calibrated from the size of uphill
+//moves on this instance and the cooling rate from the number of moves we can afford: a count that scales with the
+//number of stops, or fewer if that many won't fit before the deadline at the measured cost per move. The search stops
+//early once it has cooled down and gone a long time without improving, and leaves the best order it found in order.
+//With time windows a move's cost includes the change in lateness, looked up in a ScheduleTree of the current order.
+void DeliveryOptimizerImpl::annealPath(const PathCosts &costs, vector<int> &order, mt19937 &gen, Deadline deadline) const {
+  if (order.size() < 2 || chrono::steady_clock::now() >= deadline) { //Nothing to reorder or no time to do it
+	return;
+  }
+  int n = order.size();
+  ScheduleTree schedule(costs, order);
+  double cur_warp = schedule.whole();
+  double new_warp = 0; //Lateness after the last move evaluated
+  auto moveDelta = [&](pair<int, int> move) {
+	double delta = swapDelta(costs, order, move.first, move.second);
+	if (costs.has_windows) {
+	  new_warp = schedule.swappedTimeWarp(order, min(move.first, move.second), max(move.first, move.second));
+	  delta += kLatenessPenalty * (new_warp - cur_warp);
+	}
+	return delta;
+  };
+  double uphill = 0; //Average cost of a move that makes the path longer
+  int num_uphill = 0;
+  double downhill = 0; //And of one that makes it shorter
+  int num_downhill = 0;
+  for (int i = 0; i < 100; i++) {
+	pair<int, int> move = pickSwap(n, gen);
+	double delta = moveDelta(move);
+	if (delta > 0) {
+	  uphill += delta;
+	  num_uphill++;
+	} else if (delta < 0) {
+	  downhill -= delta;
+	  num_downhill++;
+	}
+  }
+  if (num_uphill == 0 && num_downhill == 0) { //Every stop is at the same place
+	return;
+  }
+  //If every sampled move was an improvement (a badly ordered start, like windows listed in reverse) there's no uphill
+  //move to calibrate from, the improvements are the nearest measure of how much a move is worth
+  uphill = num_uphill > 0 ? uphill / num_uphill : downhill / num_downhill;
+
+  const double t_start = uphill / log(1 / 0.8); //Start hot enough to accept an average uphill move 80% of the time
+  const double t_end = t_start * 1e-3;
+  const long max_moves = max<long>(kMinMoves, kMovesPerStop * n);
+  const long patience = max<long>(kMinPlateau, kPlateauPerStop * n); //Moves without a new best before we call it converged
+  double t = t_start;
+  double cooling_rate = pow(t_end / t_start, 1.0 / max_moves);
+  bool has_deadline = deadline != Deadline::max();
+
+  double cur_dist = costs.objective(order, kLatenessPenalty);
+  double best_dist = cur_dist;
+  vector<int> best = order;
+  long last_improvement = 0;
+  auto started = chrono::steady_clock::now();
+  std::uniform_real_distribution<> dis(0.0, 1.0);
+  for (long i = 0; i < max_moves; i++) {
+	if (i - last_improvement > patience && t < t_start * 1e-2) { //Cold and not improving any more
+	  break;
+	}
+	if (has_deadline && i % 256 == 255) { //If the deadline comes before we'd finish, cool faster so we still end up cold
+	  auto now = chrono::steady_clock::now();
+	  if (now >= deadline) {
+		break;
+	  }
+	  double per_move = chrono::duration<double>(now - started).count() / (i + 1);
+	  double moves_left = min<double>(max_moves - i, chrono::duration<double>(deadline - now).count() / per_move);
+	  cooling_rate = t > t_end ? pow(t_end / t, 1 / max(1.0, moves_left)) : 1;
+	}
+	pair<int, int> move = pickSwap(n, gen); //Randomly swap pairs of delivery locations
+	double delta = moveDelta(move);
+	if (delta < 0 || dis(gen) < exp(-delta / t)) { //Always take improvements, sometimes take a worse order to escape local minima
+	  swap(order[move.first], order[move.second]);
+	  cur_dist += delta;
+	  if (costs.has_windows) {
+		schedule.set(move.first + 1, order[move.first]);
+		schedule.set(move.second + 1, order[move.second]);
+		cur_warp = new_warp;
+	  }
+	  if (cur_dist < best_dist - 1e-12) {
+		best_dist = cur_dist; //This iteration is better, record the best distance
+		best = order;
+		last_improvement = i;
+	  }
+	}
+	t *= cooling_rate;
+  }
+  order = best;
+}
+
+//Change in path length from swapping the stops at positions a and b, only the legs touching them change
+double DeliveryOptimizerImpl::swapDelta(const PathCosts &costs, const vector<int> &order, int a, int b) const {
+  if (a > b) {
+	swap(a, b);
+  }
+  int prev_a = a == 0 ? costs.n : order[a - 1];
+  int next_b = b == (int) order.size() - 1 ? costs.n + 1 : order[b + 1];
+  int x = order[a];
+  int y = order[b];
+  if (b == a + 1) { //The leg between them is reversed, which matters when costs differ by direction
+	return costs(prev_a, y) + costs(y, x) + costs(x, next_b) - costs(prev_a, x) - costs(x, y) - costs(y, next_b);
+  }
+  int next_a = order[a + 1];
+  int prev_b = order[b - 1];
+  return costs(prev_a, y) + costs(y, next_a) + costs(prev_b, x) + costs(x, next_b)
+	  - costs(prev_a, x) - costs(x, next_a) - costs(prev_b, y) - costs(y, next_b);
+}
+
+//Splits a large manifest into clusters of nearby stops along a Hilbert curve, orders the clusters, anneals each cluster's
+//sub-tour on its own thread and then re-anneals the stops around each boundary where two clusters were stitched together
+void DeliveryOptimizerImpl::optimizeByClusters(const GeoCoord &depot, vector<DeliveryRequest> &deliveries, mt19937 &gen, Deadline deadline) const {
+  GeoBounds bounds;
+  for (const auto &d : deliveries) {
+	bounds.extend(d.location);
+  }
+  vector<pair<uint64_t, size_t>> keyed; //Hilbert index of each stop so neighbouring stops end up in the same cluster
+  for (size_t i = 0; i < deliveries.size(); i++) {
+	keyed.emplace_back(bounds.hilbertIndexOf(deliveries[i].location), i);
+  }
+  sort(keyed.begin(), keyed.end());
+
+  size_t num_clusters = (deliveries.size() + kClusterSize - 1) / kClusterSize;
+  vector<vector<DeliveryRequest>> clusters(num_clusters);
+  vector<DeliveryRequest> centroids; //One pseudo-stop per cluster
+  for (size_t c = 0; c < num_clusters; c++) {
+	size_t begin = c * deliveries.size() / num_clusters;
+	size_t end = (c + 1) * deliveries.size() / num_clusters;
+	double lat = 0, lon = 0;
+	for (size_t i = begin; i < end; i++) {
+	  clusters[c].push_back(deliveries[keyed[i].second]);
+	  lat += deliveries[keyed[i].second].location.latitude;
+	  lon += deliveries[keyed[i].second].location.longitude;
+	}
+	lat /= (end - begin);
+	lon /= (end - begin);
+	centroids.emplace_back("", GeoCoord(to_string(lat), to_string(lon)));
+  }
+  PathCosts centroid_costs(depot, depot, centroids);
+  vector<int> visits; //Visit order of the clusters
+  for (size_t c = 0; c < num_clusters; c++) {
+	visits.push_back(c);
+  }
+  orderPath(centroid_costs, visits, gen, deadline);
+
+  vector<unsigned> seeds; //Each worker gets its own generator since mt19937 isn't safe to share
+  for (size_t c = 0; c < num_clusters; c++) {
+	seeds.push_back(gen());
+  }
+  size_t num_threads = min<size_t>(max(1u, thread::hardware_concurrency()), num_clusters);
+  //With a deadline, clusters that have to wait for a free worker each get an equal share of the remaining time
+  Deadline::duration slice = Deadline::duration::max();
+  if (deadline != Deadline::max()) {
+	size_t rounds = (num_clusters + num_threads - 1) / num_threads + 1; //One extra share for polishing the joints
+	slice = (deadline - chrono::steady_clock::now()) / (long) rounds;
+  }
+  atomic<size_t> next{0};
+  auto worker = [&]() {
+	MemoryScope scope(MEM_OPTIMIZER); //Worker threads start out charged to MEM_OTHER
+	for (size_t p = next++; p < num_clusters; p = next++) {
+	  //Each cluster is a path from the previous cluster towards the next one so the sub-tours line up when stitched
+	  const GeoCoord &from = p == 0 ? depot : centroids[visits[p - 1]].location;
+	  const GeoCoord &to = p == num_clusters - 1 ? depot : centroids[visits[p + 1]].location;
+	  mt19937 local_gen(seeds[p]);
+	  Deadline cluster_deadline = slice == Deadline::duration::max() ? deadline : min(deadline, chrono::steady_clock::now() + slice);
+	  orderStops(from, to, clusters[visits[p]], local_gen, cluster_deadline);
+	}
+  };
+  vector<thread> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+	threads.emplace_back(worker);
+  }
+  worker(); //The calling thread works too
+  for (auto &th : threads) {
+	th.join();
+  }
+
+  deliveries.clear();
+  vector<size_t> joints; //Positions where one cluster's sub-tour ends and the next one begins
+  for (int c : visits) {
+	const auto &cluster = clusters[c];
+	deliveries.insert(deliveries.end(), cluster.begin(), cluster.end());
+	joints.push_back(deliveries.size());
+  }
+  joints.pop_back();
+
+  for (size_t joint : joints) { //Polish the stops on either side of every joint
+	size_t begin = joint > kJointWindow ? joint - kJointWindow : 0;
+	size_t end = min(deliveries.size(), joint + kJointWindow);
+	const GeoCoord &from = begin == 0 ? depot : deliveries[begin - 1].location;
+	const GeoCoord &to = end == deliveries.size() ? depot : deliveries[end].location;
+	vector<DeliveryRequest> window(deliveries.begin() + begin, deliveries.begin() + end);
+	orderStops(from, to, window, gen, deadline);
+	copy(window.begin(), window.end(), deliveries.begin() + begin);
+  }
+}
+
+//Road distance of the tour from the depot through the deliveries in order and back. Legs are routed until the
+//deadline and the rest count their crow distance, exact is cleared if any does. A leg without a route costs
+//kNoRoutePenalty.
+double DeliveryOptimizerImpl::roadLength(const MapSnapshot &snap, const GeoCoord &depot, const vector<DeliveryRequest> &deliveries, Deadline deadline, bool &exact) const {
+  double total_dist = 0;
+  list<StreetSegment> route;
+  const GeoCoord *last = &depot;
+  for (size_t i = 0; i <= deliveries.size(); i++) {
+	const GeoCoord &next = i == deliveries.size() ? depot : deliveries[i].location;
+	double dist = 0;
+	if (deadline != Deadline::max() && chrono::steady_clock::now() >= deadline) {
+	  dist = distanceEarthMiles(*last, next);
+	  exact = false;
+	} else if (generatePointToPointRoute(snap, *last, next, route, dist) != DELIVERY_SUCCESS) {
+	  dist = kNoRoutePenalty;
+	}
+	total_dist += dist;
+	last = &next;
+  }
+  return total_dist;
+}
+
+//Crow distance of the tour from the depot through the deliveries in order and back
+double DeliveryOptimizerImpl::crowLength(const GeoCoord &depot, const vector<DeliveryRequest> &deliveries) const {
+  double total_dist = 0;
+  const GeoCoord *last = &depot;
+  for (const auto &d : deliveries) {
+	total_dist += distanceEarthMiles(*last, d.location);
+	last = &d.location;
+  }
+  return total_dist + distanceEarthMiles(*last, depot);
+}
+
+int DeliveryOptimizerImpl::randInt(int min, int max, mt19937 &gen) const { //From Project 3 provided.h
   if (max < min)
 	std::swap(max, min);
-  static std::random_device rd;
-  static std::default_random_engine generator(rd());
   std::uniform_int_distribution<> distro(min, max);
-  return distro(generator);
+  return distro(gen);
 }
 
 //******************** DeliveryOptimizer functions ****************************
@@ -138,3 +837,15 @@ void DeliveryOptimizer::optimizeDeliveryOrder(
 	double &newCrowDistance) const {
   return m_impl->optimizeDeliveryOrder(depot, deliveries, oldCrowDistance, newCrowDistance);
 }
+
+void optimizeDeliveryOrder(
+	const MapSnapshot &map,
+	const GeoCoord &depot,
+	vector<DeliveryRequest> &deliveries,
+	vector<StopSchedule> &schedules,
+	double &oldDistance,
+	double &newDistance,
+	bool &distancesExact,
+	const PlanOptions &options) {
+  return DeliveryOptimizerImpl(nullptr).optimizeDeliveryOrder(map, depot, deliveries, schedules, oldDistance, newDistance, distancesExact, options); //Ordering on a pinned snapshot doesn't need the map
+}
@@ -1,5 +1,10 @@
 #include "provided.h"
+#include "RouterApi.h"
+#include "StreetGraph.h"
+#include "MemoryAccounting.h"
+#include "StageTiming.h"
 #include <vector>
+#include <memory_resource>
 using namespace std;
 
 class DeliveryPlannerImpl {
@@ -9,42 +14,92 @@ class DeliveryPlannerImpl {
   DeliveryResult generateDeliveryPlan(
 	  const GeoCoord &depot,
 	  const vector<DeliveryRequest> &deliveries,
+	  const vector<StopSchedule> &schedules,
 	  vector<DeliveryCommand> &commands,
-	  double &totalDistanceTravelled) const;
+	  double &totalDistanceTravelled,
+	  vector<list<StreetSegment>> *legs,
+	  vector<size_t> *unreachable,
+	  const PlanOptions &options) const;
  private:
-  PointToPointRouter router;
-  DeliveryOptimizer opt;
+  const StreetMap *map;
   string get_direction(double angle) const;
   string get_street_direction(const StreetSegment &seg) const;
   double get_street_dist(const StreetSegment &seg) const;
-  DeliveryResult addStreetSegsToRoutes(const GeoCoord &start, const GeoCoord &end, const string &item, list<list<std::pair<StreetSegment, string>>> &routes) const;
+  bool connected(const MapSnapshot &snap, const GeoCoord &a, const GeoCoord &b) const;
+  DeliveryResult addStreetSegsToRoutes(const MapSnapshot &snap, const GeoCoord &start, const GeoCoord &end, const string &item, pmr::list<pmr::list<std::pair<StreetSegment, string>>> &routes, double &distance) const;
 };
 
-DeliveryPlannerImpl::DeliveryPlannerImpl(const StreetMap *sm) : router{sm}, opt{sm} {
+DeliveryPlannerImpl::DeliveryPlannerImpl(const StreetMap *sm) : map{sm} {
 }
 
 DeliveryPlannerImpl::~DeliveryPlannerImpl() {
 }
 
-DeliveryResult DeliveryPlannerImpl::generateDeliveryPlan(const GeoCoord &depot, const vector<DeliveryRequest> &deliveries, vector<DeliveryCommand> &commands, double &totalDistanceTravelled) const {
+DeliveryResult DeliveryPlannerImpl::generateDeliveryPlan(const GeoCoord &depot, const vector<DeliveryRequest> &deliveries, const vector<StopSchedule> &schedules, vector<DeliveryCommand> &commands, double &totalDistanceTravelled, vector<list<StreetSegment>> *legs, vector<size_t> *unreachable, const PlanOptions &options) const {
+  MemoryScope scope(MEM_PLANNER);
+  RequestArena arena; //Everything the plan allocates along the way is released in one go when it's done
+  shared_ptr<const MapSnapshot> snap = mapSnapshot(*map); //The whole plan is built on one version of the map
+  if (snap == nullptr) {
+	return BAD_COORD;
+  }
+  if (unreachable != nullptr) {
+	unreachable->clear();
+  }
+  if (snap->graph->nodeOf(depot) < 0) {
+	return BAD_COORD;
+  }
+  vector<size_t> cut_off; //Find the stops we can't deliver to before spending any time on the others
+  {
+	StageTimer stage(STAGE_CHECK);
+	for (size_t i = 0; i < deliveries.size(); i++) {
+	  if (snap->graph->nodeOf(deliveries[i].location) < 0) {
+		return BAD_COORD;
+	  }
+	  if (!connected(*snap, depot, deliveries[i].location)) {
+		cut_off.push_back(i);
+	  }
+	}
+  }
+  if (!cut_off.empty()) {
+	if (unreachable != nullptr) {
+	  *unreachable = cut_off;
+	}
+	return NO_ROUTE;
+  }
   double old = 0;
+  double optimized = 0;
+  bool exact = false;
   vector<DeliveryRequest> mod = deliveries;
-  opt.optimizeDeliveryOrder(depot, mod, old, totalDistanceTravelled);
-  list<list<std::pair<StreetSegment, string>>> routes;
+  vector<StopSchedule> mod_schedules = schedules;
+  optimizeDeliveryOrder(*snap, depot, mod, mod_schedules, old, optimized, exact, options);
+  pmr::list<pmr::list<std::pair<StreetSegment, string>>> routes(requestMemory());
 
-  DeliveryResult res1 = addStreetSegsToRoutes(depot, mod[0].location, mod[0].item, routes);
+  //The optimizer's distances can be estimates when it runs short of time, the legs routed here are exact
+  totalDistanceTravelled = 0;
+  DeliveryResult res1 = addStreetSegsToRoutes(*snap, depot, mod[0].location, mod[0].item, routes, totalDistanceTravelled);
   for (int i = 0; i < mod.size() - 1; i++) {
-	DeliveryResult res = addStreetSegsToRoutes(mod[i].location, mod[i + 1].location, mod[i + 1].item, routes);
+	DeliveryResult res = addStreetSegsToRoutes(*snap, mod[i].location, mod[i + 1].location, mod[i + 1].item, routes, totalDistanceTravelled);
 	if (res != DELIVERY_SUCCESS) {
 	  return res;
 	}
   }
-  DeliveryResult res2 = addStreetSegsToRoutes(mod[mod.size() - 1].location, depot, "", routes);
+  DeliveryResult res2 = addStreetSegsToRoutes(*snap, mod[mod.size() - 1].location, depot, "", routes, totalDistanceTravelled);
 
   if (res1 != DELIVERY_SUCCESS && res2 != DELIVERY_SUCCESS) {
 	return res1;
   }
 
+  StageTimer stage(STAGE_DIRECTIONS);
+  if (legs != nullptr) { //Keep the geometry of each leg for callers that draw the route
+	legs->clear();
+	for (const auto &route : routes) {
+	  legs->emplace_back();
+	  for (const auto &jt : route) {
+		legs->back().push_back(jt.first);
+	  }
+	}
+  }
+
   commands.clear();
   int i_index = 0;
   int i_size = routes.size();
@@ -103,18 +158,37 @@ DeliveryResult DeliveryPlannerImpl::generateDeliveryPlan(const GeoCoord &depot,
   return DELIVERY_SUCCESS;
 }
 
-DeliveryResult DeliveryPlannerImpl::addStreetSegsToRoutes(const GeoCoord &start, const GeoCoord &end, const string &item, list<list<std::pair<StreetSegment, string>>> &routes) const {
+DeliveryResult DeliveryPlannerImpl::addStreetSegsToRoutes(const MapSnapshot &snap, const GeoCoord &start, const GeoCoord &end, const string &item, pmr::list<pmr::list<std::pair<StreetSegment, string>>> &routes, double &distance) const {
   list<StreetSegment> temp;
   double temp_distance = 0;
-  DeliveryResult res = router.generatePointToPointRoute(start, end, temp, temp_distance);
-  list<std::pair<StreetSegment, string>> l;
+  DeliveryResult res = generatePointToPointRoute(snap, start, end, temp, temp_distance);
+  distance += temp_distance;
+  pmr::list<std::pair<StreetSegment, string>> l(requestMemory());
   for (const auto &i : temp) { //Pair each street seg with the item being delivered
 	l.emplace_back(i, item);
   }
-  routes.push_back(l); //Add to central route list
+  routes.push_back(std::move(l)); //Add to central route list
   return res;
 }
 
+//Whether there are routes both from a to b and back, both must be in the map. The component labels answer this for
+//almost every pair, only a pair in the same component but not the same strongly connected one (which takes one-way
+//closures) needs searching.
+bool DeliveryPlannerImpl::connected(const MapSnapshot &snap, const GeoCoord &a, const GeoCoord &b) const {
+  int u = snap.graph->nodeOf(a);
+  int v = snap.graph->nodeOf(b);
+  if (snap.metric->component[u] != snap.metric->component[v]) {
+	return false;
+  }
+  if (snap.metric->strong_component[u] == snap.metric->strong_component[v]) {
+	return true;
+  }
+  list<StreetSegment> route;
+  double dist = 0;
+  return generatePointToPointRoute(snap, a, b, route, dist) == DELIVERY_SUCCESS
+	  && generatePointToPointRoute(snap, b, a, route, dist) == DELIVERY_SUCCESS;
+}
+
 string DeliveryPlannerImpl::get_street_direction(const StreetSegment &seg) const {
   return get_direction(angleOfLine(seg));
 }
@@ -164,5 +238,18 @@ DeliveryResult DeliveryPlanner::generateDeliveryPlan(
 	const vector<DeliveryRequest> &deliveries,
 	vector<DeliveryCommand> &commands,
 	double &totalDistanceTravelled) const {
-  return m_impl->generateDeliveryPlan(depot, deliveries, commands, totalDistanceTravelled);
+  return m_impl->generateDeliveryPlan(depot, deliveries, {}, commands, totalDistanceTravelled, nullptr, nullptr, PlanOptions());
+}
+
+DeliveryResult generateDeliveryPlan(
+	const StreetMap &sm,
+	const GeoCoord &depot,
+	const vector<DeliveryRequest> &deliveries,
+	const vector<StopSchedule> &schedules,
+	vector<DeliveryCommand> &commands,
+	double &totalDistanceTravelled,
+	vector<list<StreetSegment>> &legs,
+	vector<size_t> &unreachable,
+	const PlanOptions &options) {
+  return DeliveryPlannerImpl(&sm).generateDeliveryPlan(depot, deliveries, schedules, commands, totalDistanceTravelled, &legs, &unreachable, options);
 }
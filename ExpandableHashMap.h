@@ -2,10 +2,12 @@
 #define P4A_EXPANDABLEHASHMAP_H
 
 #include <vector>
-#include <list>
+#include <memory_resource>
+#include <new>
 #include <utility>
 #include <string>
 #include <algorithm>
+#include "MemoryAccounting.h"
 
 template<typename KeyType, typename ValueType>
 class ExpandableHashMap {
@@ -32,40 +34,46 @@ class ExpandableHashMap {
   struct Item {
 	KeyType key;
 	ValueType value;
+	Item *next; //Next item in the same bucket
   };
 
   double max_load_factor;
-  int num_buckets = 8;
   int num_items = 0;
-  std::list<Item *> *hash_table;
+  std::vector<Item *> hash_table; //First item of each bucket's chain
+  //Items are only ever removed all at once, so they're carved out of large blocks instead of being allocated one by one
+  std::pmr::monotonic_buffer_resource arena;
+  void destroyItems();
 };
 
 template<typename KeyType, typename ValueType>
 ExpandableHashMap<KeyType, ValueType>::ExpandableHashMap(double maximumLoadFactor) {
-  hash_table = new std::list<Item *>[num_buckets];
+  MemoryScope scope(MEM_HASH_TABLE);
+  hash_table.assign(8, nullptr);
   max_load_factor = maximumLoadFactor <= 0.0 ? 0.5 : maximumLoadFactor;
 }
 
 template<typename KeyType, typename ValueType>
 ExpandableHashMap<KeyType, ValueType>::~ExpandableHashMap() {
-  for (int i = 0; i < num_buckets; i++) {
-	for (auto j = hash_table[i].begin(); j != hash_table[i].end(); j++) {
-	  delete *j; //Deallocate memory for individual items
+  destroyItems(); //The arena hands back their memory when it goes
+}
+
+template<typename KeyType, typename ValueType>
+void ExpandableHashMap<KeyType, ValueType>::destroyItems() {
+  for (Item *head : hash_table) {
+	for (Item *i = head; i != nullptr;) {
+	  Item *next = i->next;
+	  i->~Item();
+	  i = next;
 	}
   }
-  delete[] hash_table; //Just a regular dynamic array so we can delete all at once
 }
 
 template<typename KeyType, typename ValueType>
 void ExpandableHashMap<KeyType, ValueType>::reset() {
-  for (int i = 0; i < num_buckets; i++) {
-	for (auto j = hash_table[i].begin(); j != hash_table[i].end(); j++) {
-	  delete *j; //Deallocate memory for individual items
-	}
-  }
-  delete[] hash_table;
-  hash_table = new std::list<Item *>[num_buckets];
-  num_buckets = 8;
+  MemoryScope scope(MEM_HASH_TABLE);
+  destroyItems();
+  arena.release();
+  hash_table.assign(8, nullptr);
   num_items = 0;
 }
 
@@ -76,6 +84,7 @@ int ExpandableHashMap<KeyType, ValueType>::size() const {
 
 template<typename KeyType, typename ValueType>
 void ExpandableHashMap<KeyType, ValueType>::associate(const KeyType &key, const ValueType &value) {
+  MemoryScope scope(MEM_HASH_TABLE);
   ValueType *val = find(key);
 
   if (val != nullptr) {
@@ -86,35 +95,34 @@ void ExpandableHashMap<KeyType, ValueType>::associate(const KeyType &key, const
   unsigned int hasher(const KeyType &k); // prototype
 
   ++num_items;
-  if (((double) num_items / (double) num_buckets) > max_load_factor) { //If adding the new item makes us go over our max_load_factor
-	int new_size = num_buckets * 2;
-	auto *temp_hash_table = new std::list<Item *>[new_size]; //Create new hash table
-	for (int i = 0; i < num_buckets; ++i) {
-	  std::list p = hash_table[i];
-	  for (auto it = p.begin(); it != p.end(); it++) {
-		unsigned int h = hasher((*it)->key) % new_size; //Re-hash key
-		temp_hash_table[h].push_back(*it); //Add to new hash table in (probably) a different bucket
+  if (((double) num_items / (double) hash_table.size()) > max_load_factor) { //If adding the new item makes us go over our max_load_factor
+	std::vector<Item *> temp_hash_table(hash_table.size() * 2, nullptr); //Create new hash table
+	for (Item *head : hash_table) {
+	  for (Item *i = head; i != nullptr;) {
+		Item *next = i->next;
+		unsigned int h = hasher(i->key) % temp_hash_table.size(); //Re-hash key
+		i->next = temp_hash_table[h]; //Relink into (probably) a different bucket, the item itself stays where it is
+		temp_hash_table[h] = i;
+		i = next;
 	  }
 	}
-	delete[] hash_table; //Delete lists in old hash table (but don't deallocate memory for individual items bc those are still being used)
-	hash_table = temp_hash_table;
-	num_buckets = new_size;
+	hash_table.swap(temp_hash_table);
   }
 
-  unsigned int h = hasher(key) % num_buckets; //Hash key to figure out which bucket we should put the data in
-  Item *i = new Item{key, value};
-  hash_table[h].push_back(i);
+  unsigned int h = hasher(key) % hash_table.size(); //Hash key to figure out which bucket we should put the data in
+  Item *i = new(arena.allocate(sizeof(Item), alignof(Item))) Item{key, value, hash_table[h]};
+  hash_table[h] = i;
 }
 
 template<typename KeyType, typename ValueType>
 const ValueType *ExpandableHashMap<KeyType, ValueType>::find(const KeyType &key) const {
+  MemoryScope scope(MEM_HASH_TABLE);
   unsigned int hasher(const KeyType &k); // prototype
-  unsigned int h = hasher(key) % num_buckets;
+  unsigned int h = hasher(key) % hash_table.size();
 
-  std::list p = hash_table[h];
-  for (auto it = p.begin(); it != p.end(); it++) { //Search through the correct bucket
-	if ((*it)->key == key) { //If the key matches
-	  return &((*it)->value);
+  for (const Item *i = hash_table[h]; i != nullptr; i = i->next) { //Search through the correct bucket
+	if (i->key == key) { //If the key matches
+	  return &i->value;
 	}
   }
 
@@ -0,0 +1,48 @@
+#ifndef P4A_HILBERTCURVE_H
+#define P4A_HILBERTCURVE_H
+
+#include <algorithm>
+#include <cstdint>
+#include "provided.h"
+
+//Maps (x, y) on a 2^order x 2^order grid to its distance along the Hilbert curve.
+//Points that are close along the curve are close in space, which makes the index useful for grouping and ordering GeoCoords.
+inline uint64_t hilbertIndex(uint32_t x, uint32_t y, int order = 16) {
+  uint64_t d = 0;
+  for (uint32_t s = 1u << (order - 1); s > 0; s >>= 1) {
+	uint32_t rx = (x & s) > 0;
+	uint32_t ry = (y & s) > 0;
+	d += (uint64_t) s * s * ((3 * rx) ^ ry);
+	if (ry == 0) { //Rotate the quadrant so the curve stays continuous
+	  if (rx == 1) {
+		x = s - 1 - (x & (s - 1));
+		y = s - 1 - (y & (s - 1));
+	  }
+	  std::swap(x, y);
+	}
+  }
+  return d;
+}
+
+//Bounding box of a set of GeoCoords, used to scale coordinates onto the Hilbert grid
+struct GeoBounds {
+  double min_lat = 90, max_lat = -90, min_lon = 180, max_lon = -180;
+
+  void extend(const GeoCoord &g) {
+	min_lat = std::min(min_lat, g.latitude);
+	max_lat = std::max(max_lat, g.latitude);
+	min_lon = std::min(min_lon, g.longitude);
+	max_lon = std::max(max_lon, g.longitude);
+  }
+
+  uint64_t hilbertIndexOf(const GeoCoord &g, int order = 16) const {
+	double cells = (double) ((1u << order) - 1);
+	double lat_span = max_lat > min_lat ? max_lat - min_lat : 1;
+	double lon_span = max_lon > min_lon ? max_lon - min_lon : 1;
+	auto x = (uint32_t) ((g.longitude - min_lon) / lon_span * cells);
+	auto y = (uint32_t) ((g.latitude - min_lat) / lat_span * cells);
+	return hilbertIndex(x, y, order);
+  }
+};
+
+#endif //P4A_HILBERTCURVE_H
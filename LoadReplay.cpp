@@ -0,0 +1,429 @@
+#include "LoadReplay.h"
+#include "StreetGraph.h"
+#include "StageTiming.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <utility>
+using namespace std;
+
+//Just enough JSON for manifests. Numbers keep their text so coordinates can be matched against the map exactly.
+struct JsonValue {
+  enum Type { NONE, OBJECT, ARRAY, STRING, NUMBER, LITERAL };
+  Type type = NONE;
+  string text; //A string's contents, or a number's or literal's text
+  vector<pair<string, JsonValue>> members;
+  vector<JsonValue> items;
+
+  const JsonValue *member(const string &key) const {
+	for (const auto &m : members) {
+	  if (m.first == key) {
+		return &m.second;
+	  }
+	}
+	return nullptr;
+  }
+};
+
+class JsonParser {
+ public:
+  explicit JsonParser(string_view text) : text{text} {
+  }
+
+  bool parse(JsonValue &v) { //The whole text must be one value
+	return value(v) && (skipSpace(), pos == text.size());
+  }
+
+ private:
+  static constexpr int kMaxDepth = 32; //Nesting allowed, manifests need 3 and this keeps deep input off the stack
+  string_view text;
+  size_t pos = 0;
+
+  void skipSpace() {
+	while (pos < text.size() && isspace((unsigned char) text[pos])) {
+	  pos++;
+	}
+  }
+
+  bool take(char c) {
+	skipSpace();
+	if (pos < text.size() && text[pos] == c) {
+	  pos++;
+	  return true;
+	}
+	return false;
+  }
+
+  bool value(JsonValue &v, int depth = 0) { //depth is the number of objects and arrays v is inside
+	skipSpace();
+	if (pos == text.size()) {
+	  return false;
+	}
+	char c = text[pos];
+	if ((c == '{' || c == '[') && depth == kMaxDepth) {
+	  return false;
+	}
+	if (c == '{') {
+	  pos++;
+	  v.type = JsonValue::OBJECT;
+	  if (take('}')) {
+		return true;
+	  }
+	  do {
+		string key;
+		JsonValue member;
+		if (!(skipSpace(), quoted(key)) || !take(':') || !value(member, depth + 1)) {
+		  return false;
+		}
+		v.members.emplace_back(std::move(key), std::move(member));
+	  } while (take(','));
+	  return take('}');
+	}
+	if (c == '[') {
+	  pos++;
+	  v.type = JsonValue::ARRAY;
+	  if (take(']')) {
+		return true;
+	  }
+	  do {
+		v.items.emplace_back();
+		if (!value(v.items.back(), depth + 1)) {
+		  return false;
+		}
+	  } while (take(','));
+	  return take(']');
+	}
+	if (c == '"') {
+	  v.type = JsonValue::STRING;
+	  return quoted(v.text);
+	}
+	size_t begin = pos;
+	while (pos < text.size() && (isalnum((unsigned char) text[pos]) || text[pos] == '-' || text[pos] == '+' || text[pos] == '.')) {
+	  pos++;
+	}
+	v.text = std::string(text.substr(begin, pos - begin));
+	v.type = c == '-' || isdigit((unsigned char) c) ? JsonValue::NUMBER : JsonValue::LITERAL;
+	return pos > begin && (v.type == JsonValue::NUMBER || v.text == "true" || v.text == "false" || v.text == "null");
+  }
+
+  bool quoted(std::string &out) { //At the opening quote
+	if (pos == text.size() || text[pos] != '"') {
+	  return false;
+	}
+	for (pos++; pos < text.size(); pos++) {
+	  char c = text[pos];
+	  if (c == '"') {
+		pos++;
+		return true;
+	  }
+	  if (c != '\\') {
+		out += c;
+		continue;
+	  }
+	  if (++pos == text.size()) {
+		return false;
+	  }
+	  switch (text[pos]) {
+		case 'b': out += '\b'; break;
+		case 'f': out += '\f'; break;
+		case 'n': out += '\n'; break;
+		case 'r': out += '\r'; break;
+		case 't': out += '\t'; break;
+		case 'u': { //Written out as UTF-8, surrogate pairs aren't combined
+		  if (pos + 4 >= text.size() || !all_of(text.begin() + pos + 1, text.begin() + pos + 5, [](char h) { return isxdigit((unsigned char) h); })) {
+			return false;
+		  }
+		  unsigned code = strtoul(std::string(text.substr(pos + 1, 4)).c_str(), nullptr, 16);
+		  pos += 4;
+		  if (code < 0x80) {
+			out += (char) code;
+		  } else if (code < 0x800) {
+			out += (char) (0xc0 | code >> 6);
+			out += (char) (0x80 | (code & 0x3f));
+		  } else {
+			out += (char) (0xe0 | code >> 12);
+			out += (char) (0x80 | (code >> 6 & 0x3f));
+			out += (char) (0x80 | (code & 0x3f));
+		  }
+		  break;
+		}
+		default: out += text[pos]; //Quote, backslash and slash stand for themselves
+	  }
+	}
+	return false;
+  }
+};
+
+static bool parseNumber(const string &text, double &value) { //The whole text must be a finite number
+  char *end = nullptr;
+  value = strtod(text.c_str(), &end);
+  return !text.empty() && end == text.c_str() + text.size() && isfinite(value);
+}
+
+//GeoCoord converts its texts with stod, so they're checked here first
+static bool parseCoord(const JsonValue *v, GeoCoord &g) {
+  string lat, lon;
+  if (v == nullptr) {
+	return false;
+  }
+  if (v->type == JsonValue::STRING) {
+	istringstream iss(v->text);
+	if (!(iss >> lat >> lon)) {
+	  return false;
+	}
+  } else if (v->type == JsonValue::ARRAY && v->items.size() == 2 && v->items[0].type == JsonValue::NUMBER && v->items[1].type == JsonValue::NUMBER) {
+	lat = v->items[0].text;
+	lon = v->items[1].text;
+  } else {
+	return false;
+  }
+  double unused;
+  if (!parseNumber(lat, unused) || !parseNumber(lon, unused)) {
+	return false;
+  }
+  g = GeoCoord(lat, lon);
+  return true;
+}
+
+static bool parseManifest(const JsonValue &v, ReplayManifest &m) {
+  const JsonValue *deliveries = v.member("deliveries");
+  if (!parseCoord(v.member("depot"), m.depot) || deliveries == nullptr || deliveries->type != JsonValue::ARRAY || deliveries->items.empty()) {
+	return false;
+  }
+  bool scheduled = false;
+  for (const auto &d : deliveries->items) {
+	const JsonValue *item = d.member("item");
+	DeliveryRequest request(item != nullptr && item->type == JsonValue::STRING ? item->text : "", GeoCoord());
+	if (!parseCoord(d.member("location"), request.location)) {
+	  return false;
+	}
+	StopSchedule schedule;
+	pair<const char *, double *> optional[] = {{"windowStart", &schedule.windowStart}, {"windowEnd", &schedule.windowEnd}, {"serviceMinutes", &schedule.serviceMinutes}};
+	for (auto &field : optional) {
+	  const JsonValue *n = d.member(field.first);
+	  if (n != nullptr && (n->type != JsonValue::NUMBER || !parseNumber(n->text, *field.second))) {
+		return false;
+	  }
+	  scheduled |= n != nullptr;
+	}
+	m.deliveries.push_back(request);
+	m.schedules.push_back(schedule);
+  }
+  if (!scheduled) {
+	m.schedules.clear();
+  }
+  return true;
+}
+
+bool loadManifests(const string &file, vector<ReplayManifest> &manifests, string &error) {
+  ifstream in(file);
+  if (!in) {
+	error = "Unable to open " + file;
+	return false;
+  }
+  string line;
+  for (int number = 1; getline(in, line); number++) {
+	if (line.find_first_not_of(" \t\r") == string::npos) {
+	  continue;
+	}
+	JsonValue v;
+	ReplayManifest m;
+	if (!JsonParser(line).parse(v) || !parseManifest(v, m)) {
+	  error = file + ":" + to_string(number) + ": not a manifest";
+	  return false;
+	}
+	manifests.push_back(m);
+  }
+  return true;
+}
+
+static void writeString(ostream &out, const string &s) {
+  out << '"';
+  for (char c : s) {
+	if (c == '"' || c == '\\') {
+	  out << '\\' << c;
+	} else if ((unsigned char) c < 0x20) {
+	  out << "\\u" << hex << setw(4) << setfill('0') << (int) c << dec << setfill(' ');
+	} else {
+	  out << c;
+	}
+  }
+  out << '"';
+}
+
+void writeManifest(ostream &out, const ReplayManifest &manifest) {
+  out << "{\"depot\": ";
+  writeString(out, manifest.depot.latitudeText + " " + manifest.depot.longitudeText);
+  out << ", \"deliveries\": [";
+  for (size_t i = 0; i < manifest.deliveries.size(); i++) {
+	const DeliveryRequest &d = manifest.deliveries[i];
+	out << (i == 0 ? "" : ", ") << "{\"item\": ";
+	writeString(out, d.item);
+	out << ", \"location\": ";
+	writeString(out, d.location.latitudeText + " " + d.location.longitudeText);
+	StopSchedule s = manifest.schedules.empty() ? StopSchedule() : manifest.schedules[i];
+	if (s.hasTimeWindow()) {
+	  out << ", \"windowStart\": " << s.windowStart;
+	  if (s.windowEnd != numeric_limits<double>::infinity()) {
+		out << ", \"windowEnd\": " << s.windowEnd;
+	  }
+	}
+	if (s.serviceMinutes > 0) {
+	  out << ", \"serviceMinutes\": " << s.serviceMinutes;
+	}
+	out << "}";
+  }
+  out << "]}\n";
+}
+
+//Depots and stops all come from the largest strongly connected component, so every synthesized plan can succeed
+vector<ReplayManifest> synthesizeManifests(const StreetMap &sm, int count, unsigned seed) {
+  vector<ReplayManifest> manifests;
+  shared_ptr<const MapSnapshot> snap = mapSnapshot(sm);
+  if (snap == nullptr || snap->graph->numNodes() == 0) {
+	return manifests;
+  }
+  const vector<int> &component = snap->metric->strong_component;
+  vector<int> size(*max_element(component.begin(), component.end()) + 1, 0);
+  for (int c : component) {
+	size[c]++;
+  }
+  int largest = max_element(size.begin(), size.end()) - size.begin();
+  vector<int> nodes;
+  for (int v = 0; v < snap->graph->numNodes(); v++) {
+	if (component[v] == largest) {
+	  nodes.push_back(v);
+	}
+  }
+  mt19937 gen(seed);
+  uniform_int_distribution<size_t> pick(0, nodes.size() - 1);
+  uniform_int_distribution<int> stops(5, 40);
+  for (int i = 0; i < count; i++) {
+	ReplayManifest m;
+	m.depot = snap->graph->coords[nodes[pick(gen)]];
+	for (int s = stops(gen); s > 0; s--) {
+	  m.deliveries.emplace_back("Parcel " + to_string(m.deliveries.size() + 1), snap->graph->coords[nodes[pick(gen)]]);
+	}
+	manifests.push_back(m);
+  }
+  return manifests;
+}
+
+//One plan as the harness saw it. Latency runs from when the plan arrived, so it includes waiting for a free worker.
+struct ReplaySample {
+  double latency = 0;
+  double service = 0;
+  DeliveryResult result = DELIVERY_SUCCESS;
+  StageTimes stages;
+};
+
+static double percentile(vector<double> v, double p) { //Nearest rank
+  if (v.empty()) {
+	return 0;
+  }
+  sort(v.begin(), v.end());
+  size_t rank = (size_t) ceil(p * v.size());
+  return v[min(v.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
+
+static void reportRow(ostream &report, const string &name, const vector<double> &seconds) {
+  double mean = 0;
+  for (double s : seconds) {
+	mean += s;
+  }
+  mean /= max<size_t>(1, seconds.size());
+  report << left << setw(12) << name << right;
+  for (double value : {mean, percentile(seconds, 0.5), percentile(seconds, 0.99), percentile(seconds, 0.999), percentile(seconds, 1)}) {
+	report << setw(12) << value * 1000;
+  }
+  report << '\n';
+}
+
+//Workers take plans in order. With an arrival rate every plan gets a Poisson arrival time up front and a worker that
+//gets to it early waits for it, so a backlog shows up as latency rather than slowing the arrivals down.
+void replayManifests(const StreetMap &sm, const vector<ReplayManifest> &manifests, const ReplayOptions &options, ostream &report) {
+  using Clock = chrono::steady_clock;
+  size_t total = manifests.size() * max(1, options.passes);
+  if (total == 0) {
+	report << "No manifests to replay.\n";
+	return;
+  }
+  bool open_loop = options.arrivalsPerSecond > 0;
+  vector<Clock::duration> arrival(total, Clock::duration::zero());
+  if (open_loop) {
+	mt19937 gen(1);
+	exponential_distribution<double> gap(options.arrivalsPerSecond);
+	double at = 0;
+	for (size_t i = 0; i < total; i++) {
+	  arrival[i] = chrono::duration_cast<Clock::duration>(chrono::duration<double>(at));
+	  at += gap(gen);
+	}
+  }
+
+  vector<ReplaySample> samples(total);
+  atomic<size_t> next{0};
+  Clock::time_point start = Clock::now();
+  vector<Clock::time_point> finished(max(1, options.concurrency), start);
+  auto worker = [&](int w) {
+	for (size_t i = next++; i < total; i = next++) {
+	  const ReplayManifest &m = manifests[i % manifests.size()];
+	  Clock::time_point arrived = open_loop ? start + arrival[i] : Clock::now();
+	  this_thread::sleep_until(arrived);
+	  Clock::time_point begin = Clock::now();
+	  resetStageTimes();
+	  vector<DeliveryCommand> commands;
+	  vector<list<StreetSegment>> legs;
+	  vector<size_t> unreachable;
+	  double miles = 0;
+	  samples[i].result = generateDeliveryPlan(sm, m.depot, m.deliveries, m.schedules, commands, miles, legs, unreachable, options.plan);
+	  samples[i].stages = stageTimes();
+	  finished[w] = Clock::now();
+	  samples[i].latency = chrono::duration<double>(finished[w] - arrived).count();
+	  samples[i].service = chrono::duration<double>(finished[w] - begin).count();
+	}
+  };
+  vector<thread> threads;
+  for (int w = 1; w < options.concurrency; w++) {
+	threads.emplace_back(worker, w);
+  }
+  worker(0);
+  for (auto &t : threads) {
+	t.join();
+  }
+  double elapsed = chrono::duration<double>(*max_element(finished.begin(), finished.end()) - start).count();
+
+  size_t outcomes[3] = {0, 0, 0};
+  vector<double> latency, service;
+  vector<vector<double>> stages(STAGE_NUM_STAGES);
+  for (const auto &s : samples) {
+	outcomes[s.result]++;
+	latency.push_back(s.latency);
+	service.push_back(s.service);
+	for (int st = 0; st < STAGE_NUM_STAGES; st++) {
+	  stages[st].push_back(s.stages.seconds[st]);
+	}
+  }
+  report << fixed << setprecision(2);
+  report << "Replayed " << total << " plans on " << max(1, options.concurrency) << " worker(s), ";
+  if (open_loop) {
+	report << "Poisson arrivals at " << options.arrivalsPerSecond << "/s";
+  } else {
+	report << "each starting as soon as a worker was free";
+  }
+  report << ", in " << elapsed << " s: " << total / max(elapsed, 1e-9) << " plans/s\n";
+  report << outcomes[DELIVERY_SUCCESS] << " planned, " << outcomes[NO_ROUTE] << " with no route, " << outcomes[BAD_COORD] << " with bad coordinates\n\n";
+  report << left << setw(12) << "ms" << right << setw(12) << "mean" << setw(12) << "p50" << setw(12) << "p99" << setw(12) << "p999" << setw(12) << "max" << '\n';
+  reportRow(report, "latency", latency);
+  reportRow(report, "service", service);
+  for (int st = 0; st < STAGE_NUM_STAGES; st++) {
+	reportRow(report, string("  ") + stageName(PlanStage(st)), stages[st]);
+  }
+}
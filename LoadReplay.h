@@ -0,0 +1,34 @@
+#ifndef P4A_LOADREPLAY_H
+#define P4A_LOADREPLAY_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include "provided.h"
+#include "RouterApi.h"
+
+//Load generation for the planning pipeline. A manifest stream is JSONL, one plan request per line:
+//  {"depot": "34.0625329 -118.4470263", "deliveries": [{"item": "Chicken tenders", "location": "34.0712323 -118.4505969"}]}
+//Coordinates are "lat lon" strings (or [lat, lon] arrays) written exactly as in the map file. A delivery can also have
+//"windowStart", "windowEnd" and "serviceMinutes". A line that isn't a manifest with at least one delivery is an error.
+struct ReplayManifest {
+  GeoCoord depot;
+  std::vector<DeliveryRequest> deliveries;
+  std::vector<StopSchedule> schedules; //Empty, or one per delivery when any delivery has scheduling fields
+};
+
+struct ReplayOptions {
+  int concurrency = 1; //Plans in flight at once, each on its own thread
+  double arrivalsPerSecond = 0; //Poisson arrivals at this mean rate, 0 to start each plan as soon as a worker is free
+  int passes = 1; //Times the whole stream is replayed
+  PlanOptions plan;
+};
+
+bool loadManifests(const std::string &file, std::vector<ReplayManifest> &manifests, std::string &error);
+void writeManifest(std::ostream &out, const ReplayManifest &manifest);
+//Random manifests of 5 to 40 stops, each stop reachable from its depot
+std::vector<ReplayManifest> synthesizeManifests(const StreetMap &sm, int count, unsigned seed);
+//Plans every manifest and reports throughput, latency percentiles and where the time went
+void replayManifests(const StreetMap &sm, const std::vector<ReplayManifest> &manifests, const ReplayOptions &options, std::ostream &report);
+
+#endif //P4A_LOADREPLAY_H
@@ -0,0 +1,272 @@
+#include "MemoryAccounting.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <iomanip>
+using namespace std;
+
+static thread_local MemorySubsystem active = MEM_OTHER;
+static thread_local pmr::memory_resource *request_memory = nullptr; //Innermost open RequestArena's pool
+
+#ifdef MEMORY_ACCOUNTING
+
+//Replaces the global operator new/delete. Each block carries a small header recording its size and the subsystem it
+//was charged to, so it can be credited back correctly whichever thread or scope frees it.
+
+struct Counters {
+  atomic<size_t> current{0};
+  atomic<size_t> peak{0};
+  atomic<size_t> allocations{0};
+};
+
+static Counters counters[MEM_NUM_SUBSYSTEMS];
+static Counters total;
+
+static const size_t kHeaderSize = alignof(max_align_t) > 16 ? alignof(max_align_t) : 16; //Keeps the block aligned
+
+struct Header {
+  size_t size;
+  MemorySubsystem subsystem;
+};
+
+static void charge(Counters &c, size_t size) {
+  size_t now = c.current.fetch_add(size, memory_order_relaxed) + size;
+  size_t peak = c.peak.load(memory_order_relaxed);
+  while (now > peak && !c.peak.compare_exchange_weak(peak, now, memory_order_relaxed)) {
+  }
+  c.allocations.fetch_add(1, memory_order_relaxed);
+}
+
+static void *allocate(size_t size) {
+  void *block = malloc(size + kHeaderSize);
+  if (block == nullptr) {
+	return nullptr;
+  }
+  auto *h = static_cast<Header *>(block);
+  h->size = size;
+  h->subsystem = active;
+  charge(counters[active], size);
+  charge(total, size);
+  return static_cast<char *>(block) + kHeaderSize;
+}
+
+static void deallocate(void *p) {
+  if (p == nullptr) {
+	return;
+  }
+  void *block = static_cast<char *>(p) - kHeaderSize;
+  auto *h = static_cast<Header *>(block);
+  counters[h->subsystem].current.fetch_sub(h->size, memory_order_relaxed);
+  total.current.fetch_sub(h->size, memory_order_relaxed);
+  free(block);
+}
+
+//Over-aligned blocks (pmr resources ask for these) put the header just before the returned pointer and start one
+//alignment's worth earlier, so the block is found again from the pointer and the alignment the caller frees it with
+static void *allocateAligned(size_t size, size_t align) {
+  if (align <= kHeaderSize) {
+	return allocate(size);
+  }
+  void *block = aligned_alloc(align, (size + 2 * align - 1) / align * align);
+  if (block == nullptr) {
+	return nullptr;
+  }
+  char *p = static_cast<char *>(block) + align;
+  auto *h = reinterpret_cast<Header *>(p - kHeaderSize);
+  h->size = size;
+  h->subsystem = active;
+  charge(counters[active], size);
+  charge(total, size);
+  return p;
+}
+
+static void deallocateAligned(void *p, size_t align) {
+  if (align <= kHeaderSize || p == nullptr) {
+	deallocate(p);
+	return;
+  }
+  auto *h = reinterpret_cast<Header *>(static_cast<char *>(p) - kHeaderSize);
+  counters[h->subsystem].current.fetch_sub(h->size, memory_order_relaxed);
+  total.current.fetch_sub(h->size, memory_order_relaxed);
+  free(static_cast<char *>(p) - align);
+}
+
+static MemoryUsage read(const Counters &c) {
+  MemoryUsage u;
+  u.currentBytes = c.current.load(memory_order_relaxed);
+  u.peakBytes = c.peak.load(memory_order_relaxed);
+  u.allocations = c.allocations.load(memory_order_relaxed);
+  return u;
+}
+
+void *operator new(size_t size) {
+  void *p = allocate(size);
+  if (p == nullptr) {
+	throw bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void *operator new(size_t size, const nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+void *operator new[](size_t size, const nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+void operator delete(void *p) noexcept {
+  deallocate(p);
+}
+
+void operator delete[](void *p) noexcept {
+  deallocate(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  deallocate(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+  deallocate(p);
+}
+
+void operator delete(void *p, const nothrow_t &) noexcept {
+  deallocate(p);
+}
+
+void operator delete[](void *p, const nothrow_t &) noexcept {
+  deallocate(p);
+}
+
+void *operator new(size_t size, align_val_t align) {
+  void *p = allocateAligned(size, size_t(align));
+  if (p == nullptr) {
+	throw bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size, align_val_t align) {
+  return operator new(size, align);
+}
+
+void *operator new(size_t size, align_val_t align, const nothrow_t &) noexcept {
+  return allocateAligned(size, size_t(align));
+}
+
+void *operator new[](size_t size, align_val_t align, const nothrow_t &) noexcept {
+  return allocateAligned(size, size_t(align));
+}
+
+void operator delete(void *p, align_val_t align) noexcept {
+  deallocateAligned(p, size_t(align));
+}
+
+void operator delete[](void *p, align_val_t align) noexcept {
+  deallocateAligned(p, size_t(align));
+}
+
+void operator delete(void *p, size_t, align_val_t align) noexcept {
+  deallocateAligned(p, size_t(align));
+}
+
+void operator delete[](void *p, size_t, align_val_t align) noexcept {
+  deallocateAligned(p, size_t(align));
+}
+
+void operator delete(void *p, align_val_t align, const nothrow_t &) noexcept {
+  deallocateAligned(p, size_t(align));
+}
+
+void operator delete[](void *p, align_val_t align, const nothrow_t &) noexcept {
+  deallocateAligned(p, size_t(align));
+}
+
+MemoryUsage memoryUsage(MemorySubsystem s) {
+  return read(counters[s]);
+}
+
+MemoryUsage totalMemoryUsage() {
+  return read(total);
+}
+
+void resetPeakMemory() {
+  for (auto &c : counters) {
+	c.peak.store(c.current.load(memory_order_relaxed), memory_order_relaxed);
+  }
+  total.peak.store(total.current.load(memory_order_relaxed), memory_order_relaxed);
+}
+
+bool memoryAccountingEnabled() {
+  return true;
+}
+
+#else
+
+MemoryUsage memoryUsage(MemorySubsystem) {
+  return MemoryUsage();
+}
+
+MemoryUsage totalMemoryUsage() {
+  return MemoryUsage();
+}
+
+void resetPeakMemory() {
+}
+
+bool memoryAccountingEnabled() {
+  return false;
+}
+
+#endif //MEMORY_ACCOUNTING
+
+const char *memorySubsystemName(MemorySubsystem s) {
+  switch (s) {
+	case MEM_OTHER: return "other";
+	case MEM_STREET_MAP: return "street map";
+	case MEM_HASH_TABLE: return "hash tables";
+	case MEM_ROUTER: return "router";
+	case MEM_OPTIMIZER: return "optimizer";
+	case MEM_PLANNER: return "planner";
+	default: return "?";
+  }
+}
+
+void reportMemoryUsage(ostream &out) {
+  out << left << setw(14) << "subsystem" << right << setw(14) << "current" << setw(14) << "peak" << setw(14) << "allocations" << '\n';
+  for (int s = 0; s < MEM_NUM_SUBSYSTEMS; s++) {
+	MemoryUsage u = memoryUsage(MemorySubsystem(s));
+	out << left << setw(14) << memorySubsystemName(MemorySubsystem(s)) << right << setw(14) << u.currentBytes << setw(14) << u.peakBytes << setw(14) << u.allocations << '\n';
+  }
+  MemoryUsage u = totalMemoryUsage();
+  out << left << setw(14) << "total" << right << setw(14) << u.currentBytes << setw(14) << u.peakBytes << setw(14) << u.allocations << '\n';
+}
+
+MemorySubsystem activeMemorySubsystem() {
+  return active;
+}
+
+MemoryScope::MemoryScope(MemorySubsystem s) : previous{active} {
+  active = s;
+}
+
+MemoryScope::~MemoryScope() {
+  active = previous;
+}
+
+pmr::memory_resource *requestMemory() {
+  return request_memory == nullptr ? pmr::new_delete_resource() : request_memory;
+}
+
+RequestArena::RequestArena() : previous{request_memory}, pool{requestMemory()} {
+  request_memory = &pool;
+}
+
+RequestArena::~RequestArena() {
+  request_memory = previous;
+}
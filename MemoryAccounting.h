@@ -0,0 +1,65 @@
+#ifndef P4A_MEMORYACCOUNTING_H
+#define P4A_MEMORYACCOUNTING_H
+
+#include <cstddef>
+#include <ostream>
+#include <memory_resource>
+
+//Every heap allocation in the program is charged to the subsystem that is active on the allocating thread when it
+//happens (MEM_OTHER unless a MemoryScope says otherwise) and credited back to the same subsystem when it's freed.
+//Counting puts shared atomics and a header on every allocation, so it's only built in with -DMEMORY_ACCOUNTING.
+//Without it the global heap is left alone and every usage reads as zero.
+enum MemorySubsystem {
+  MEM_OTHER,
+  MEM_STREET_MAP, //Graph arrays, GeoCoord strings, snapshots and edge weights
+  MEM_HASH_TABLE, //ExpandableHashMap buckets and items
+  MEM_ROUTER, //Per-query search state and the routes handed back
+  MEM_OPTIMIZER,
+  MEM_PLANNER,
+  MEM_NUM_SUBSYSTEMS
+};
+
+struct MemoryUsage {
+  size_t currentBytes = 0;
+  size_t peakBytes = 0; //Highest currentBytes since the last resetPeakMemory()
+  size_t allocations = 0; //Number of allocations made, ever
+};
+
+bool memoryAccountingEnabled(); //Whether this build counts allocations
+MemoryUsage memoryUsage(MemorySubsystem s);
+MemoryUsage totalMemoryUsage();
+void resetPeakMemory(); //Start a new peak measurement for every subsystem, e.g. before a plan
+const char *memorySubsystemName(MemorySubsystem s);
+void reportMemoryUsage(std::ostream &out);
+MemorySubsystem activeMemorySubsystem(); //What allocations on this thread are charged to right now
+
+//Charges allocations made on this thread to a subsystem until the scope ends. Scopes nest.
+class MemoryScope {
+ public:
+  explicit MemoryScope(MemorySubsystem s);
+  ~MemoryScope();
+  MemoryScope(const MemoryScope &) = delete;
+  MemoryScope &operator=(const MemoryScope &) = delete;
+ private:
+  MemorySubsystem previous;
+};
+
+//Memory for one request on one thread. While an arena is open, requestMemory() on its thread is a pool that keeps
+//freed blocks for the rest of the request instead of handing them back to the global heap, and everything goes back
+//in one go when the arena closes. A pool is never shared between threads, so requests don't contend for the heap.
+//Arenas nest, an inner one draws its blocks from the outer one. Without an arena requestMemory() is the global heap.
+//Containers using requestMemory() must not outlive the arena or be grown by another thread.
+class RequestArena {
+ public:
+  RequestArena();
+  ~RequestArena();
+  RequestArena(const RequestArena &) = delete;
+  RequestArena &operator=(const RequestArena &) = delete;
+ private:
+  std::pmr::memory_resource *previous;
+  std::pmr::unsynchronized_pool_resource pool;
+};
+
+std::pmr::memory_resource *requestMemory();
+
+#endif //P4A_MEMORYACCOUNTING_H
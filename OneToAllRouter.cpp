@@ -0,0 +1,504 @@
+#include "provided.h"
+#include "RouterApi.h"
+#include "StreetGraph.h"
+#include "MemoryAccounting.h"
+#include "ParallelFor.h"
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <queue>
+#include <vector>
+using namespace std;
+
+//Contraction hierarchy over one snapshot's graph and metric, laid out for PHAST sweeps. Every node has a rank and the
+//hierarchy's edges (map edges plus shortcuts) only go up or down in rank, so a shortest path always climbs and then
+//descends. The exception is the core: the most important nodes, left uncontracted once the rest of the graph has
+//become too dense to contract cheaply. Edges between core nodes are stored as up edges, so the climbing search simply
+//carries on through the core. Nodes are stored by position, most important (the core) first, so a sweep in
+//decreasing rank walks every array front to back.
+struct ContractionHierarchy {
+  vector<int> node_at; //Position -> node id in the graph
+  vector<int> position_of; //Node id -> position
+  vector<int> first_up; //Position -> first edge to a more important node (extra entry at the end)
+  vector<int> up_head; //Up edge -> position it leads to
+  vector<double> up_weight;
+  vector<int> first_down; //Position -> first edge coming in from a more important node (extra entry at the end)
+  vector<int> down_tail; //Down edge -> position it comes from
+  vector<double> down_weight;
+  int core_size = 0; //Positions below this are the core
+
+  int numNodes() const {
+	return (int) node_at.size();
+  }
+};
+
+//Contracts the nodes of a graph one at a time, least important first. Removing a node adds a shortcut between each
+//pair of its remaining neighbours whose shortest connection went through it, unless a bounded witness search finds
+//another path that is at least as short. A node's importance is the number of edges contracting it would add minus
+//the number it removes, plus the number of its neighbours that are already gone so contraction spreads evenly.
+//Arcs to a contracted node are dropped from its neighbours, so when a node is contracted its arcs are exactly its
+//edges to more important nodes.
+//
+//Choosing the order is most of the work, and an order that was good for one metric of a graph stays good for the
+//others, so a hierarchy for new weights can be built by contracting in an earlier hierarchy's order. The witness
+//searches still run on the new weights, which keeps the result exact.
+class HierarchyBuilder {
+ public:
+  HierarchyBuilder(const StreetGraph &graph, const EdgeMetric &metric);
+  shared_ptr<ContractionHierarchy> build();
+  shared_ptr<ContractionHierarchy> build(const ContractionHierarchy &order); //Same order and core as order
+
+ private:
+  static constexpr int kWitnessSettleLimit = 500; //Nodes a witness search may settle before it assumes there's no witness
+  static constexpr int kSimulatedSettleLimit = 25; //Same when only estimating a node's importance
+  static constexpr size_t kCoreDegree = 64; //Contraction stops when the next node has more arcs than this
+  struct Arc {
+	int node;
+	double weight;
+  };
+
+  int num_nodes;
+  vector<vector<Arc>> out; //Arcs leaving each node, including shortcuts
+  vector<vector<Arc>> in; //Arcs entering each node, including shortcuts
+  vector<int> deleted_neighbours;
+  vector<double> witness_dist; //Scratch for witness searches, reset after each search
+  vector<int> witness_touched;
+  vector<bool> witness_target; //Nodes the current witness searches are looking for
+  vector<pair<double, int>> witness_heap;
+
+  void addArc(int from, int to, double weight);
+  void removeArcs(int v);
+  int contract(int v, bool simulate);
+  int priority(int v);
+  void witnessSearch(int source, int skip, double limit, int targets, int settle_limit);
+  void contractNode(int v);
+  shared_ptr<ContractionHierarchy> layOut(vector<int> &rank, int core_begin);
+};
+
+HierarchyBuilder::HierarchyBuilder(const StreetGraph &graph, const EdgeMetric &metric)
+	: num_nodes{graph.numNodes()}, out(graph.numNodes()), in(graph.numNodes()), deleted_neighbours(graph.numNodes(), 0), witness_dist(graph.numNodes(), numeric_limits<double>::infinity()),
+	  witness_target(graph.numNodes(), false) {
+  for (int e = 0; e < graph.numEdges(); e++) {
+	if (metric.weight[e] != EdgeMetric::closed() && graph.edge_tail[e] != graph.edge_head[e]) {
+	  addArc(graph.edge_tail[e], graph.edge_head[e], metric.weight[e]);
+	}
+  }
+}
+
+void HierarchyBuilder::addArc(int from, int to, double weight) { //Parallel arcs collapse into the cheapest one
+  for (Arc &a : out[from]) {
+	if (a.node == to) {
+	  if (weight < a.weight) {
+		a.weight = weight;
+		for (Arc &b : in[to]) {
+		  if (b.node == from) {
+			b.weight = weight;
+		  }
+		}
+	  }
+	  return;
+	}
+  }
+  out[from].push_back({to, weight});
+  in[to].push_back({from, weight});
+}
+
+//Removes the arcs between v and its neighbours from the neighbours' side once v is contracted
+void HierarchyBuilder::removeArcs(int v) {
+  auto drop = [v](vector<Arc> &arcs) {
+	for (size_t i = 0; i < arcs.size(); i++) {
+	  if (arcs[i].node == v) {
+		arcs[i] = arcs.back();
+		arcs.pop_back();
+		return;
+	  }
+	}
+  };
+  for (const Arc &a : out[v]) {
+	drop(in[a.node]);
+  }
+  for (const Arc &a : in[v]) {
+	drop(out[a.node]);
+  }
+}
+
+//Dijkstra from source over the nodes that are left, not passing through skip, until the given number of
+//witness_target nodes are settled, everything closer than limit is settled or settle_limit nodes are. Leaves the
+//distances in witness_dist.
+void HierarchyBuilder::witnessSearch(int source, int skip, double limit, int targets, int settle_limit) {
+  for (int v : witness_touched) {
+	witness_dist[v] = numeric_limits<double>::infinity();
+  }
+  witness_touched.clear();
+  witness_heap.clear();
+  witness_dist[source] = 0;
+  witness_touched.push_back(source);
+  witness_heap.push_back({0, source});
+  int settled = 0;
+  while (!witness_heap.empty() && settled < settle_limit && targets > 0) {
+	pair<double, int> top = witness_heap.front();
+	pop_heap(witness_heap.begin(), witness_heap.end(), greater<>());
+	witness_heap.pop_back();
+	if (top.first > witness_dist[top.second]) { //Stale entry
+	  continue;
+	}
+	if (top.first > limit) {
+	  break;
+	}
+	settled++;
+	targets -= witness_target[top.second];
+	for (const Arc &a : out[top.second]) {
+	  if (a.node == skip) {
+		continue;
+	  }
+	  double d = top.first + a.weight;
+	  if (d < witness_dist[a.node]) {
+		if (witness_dist[a.node] == numeric_limits<double>::infinity()) {
+		  witness_touched.push_back(a.node);
+		}
+		witness_dist[a.node] = d;
+		witness_heap.push_back({d, a.node});
+		push_heap(witness_heap.begin(), witness_heap.end(), greater<>());
+	  }
+	}
+  }
+}
+
+//Returns the number of shortcuts contracting v needs, and adds them unless simulate is set
+int HierarchyBuilder::contract(int v, bool simulate) {
+  double max_out = 0;
+  for (const Arc &b : out[v]) {
+	max_out = max(max_out, b.weight);
+	witness_target[b.node] = true;
+  }
+  int shortcuts = 0;
+  for (const Arc &a : in[v]) {
+	witnessSearch(a.node, v, a.weight + max_out, out[v].size(), simulate ? kSimulatedSettleLimit : kWitnessSettleLimit);
+	for (const Arc &b : out[v]) {
+	  if (b.node == a.node) {
+		continue;
+	  }
+	  double via = a.weight + b.weight;
+	  //No path around v that's as short, so keep this one as a shortcut. A witness that is only longer by rounding
+	  //counts, otherwise the many equally long paths through a street grid would all turn into shortcuts.
+	  if (witness_dist[b.node] > via * (1 + 1e-12)) {
+		shortcuts++;
+		if (!simulate) {
+		  addArc(a.node, b.node, via);
+		}
+	  }
+	}
+  }
+  for (const Arc &b : out[v]) {
+	witness_target[b.node] = false;
+  }
+  return shortcuts;
+}
+
+int HierarchyBuilder::priority(int v) {
+  return contract(v, true) - (int) (out[v].size() + in[v].size()) + deleted_neighbours[v];
+}
+
+shared_ptr<ContractionHierarchy> HierarchyBuilder::build() {
+  priority_queue<pair<int, int>, vector<pair<int, int>>, greater<>> queue; //(priority, node), least important first
+  for (int v = 0; v < num_nodes; v++) {
+	queue.push({priority(v), v});
+  }
+  vector<int> rank(num_nodes, -1);
+  int next_rank = 0;
+  while (!queue.empty()) {
+	int v = queue.top().second;
+	queue.pop();
+	int p = priority(v); //Priorities go stale as neighbours are contracted, so check again before committing
+	if (!queue.empty() && p > queue.top().first) {
+	  queue.push({p, v});
+	  continue;
+	}
+	if (out[v].size() + in[v].size() > kCoreDegree) { //What's left is too dense, it becomes the core
+	  break;
+	}
+	contractNode(v);
+	rank[v] = next_rank++;
+  }
+  return layOut(rank, next_rank);
+}
+
+shared_ptr<ContractionHierarchy> HierarchyBuilder::build(const ContractionHierarchy &order) {
+  vector<int> rank(num_nodes, -1);
+  int next_rank = 0;
+  for (int p = num_nodes - 1; p >= order.core_size; p--) { //Least important first
+	int v = order.node_at[p];
+	contractNode(v);
+	rank[v] = next_rank++;
+  }
+  return layOut(rank, next_rank);
+}
+
+void HierarchyBuilder::contractNode(int v) {
+  contract(v, false);
+  removeArcs(v);
+  for (const Arc &a : out[v]) {
+	deleted_neighbours[a.node]++;
+  }
+  for (const Arc &a : in[v]) {
+	deleted_neighbours[a.node]++;
+  }
+}
+
+//Turns the arcs left after contracting every node ranked below core_begin into the hierarchy's arrays. Nodes that
+//weren't contracted (rank -1) become the core.
+shared_ptr<ContractionHierarchy> HierarchyBuilder::layOut(vector<int> &rank, int core_begin) {
+  int next_rank = core_begin; //Nodes that weren't contracted rank above all the others
+  for (int v = 0; v < num_nodes; v++) {
+	if (rank[v] < 0) {
+	  rank[v] = next_rank++;
+	}
+  }
+
+  //A contracted node's arcs all lead to more important nodes, out arcs are its up edges and in arcs its down edges.
+  //A core node's arcs stay within the core and are all kept as up edges.
+  auto ch = make_shared<ContractionHierarchy>();
+  ch->core_size = num_nodes - core_begin;
+  ch->node_at.resize(num_nodes);
+  ch->position_of.resize(num_nodes);
+  for (int v = 0; v < num_nodes; v++) {
+	ch->position_of[v] = num_nodes - 1 - rank[v];
+	ch->node_at[ch->position_of[v]] = v;
+  }
+  ch->first_up.push_back(0);
+  ch->first_down.push_back(0);
+  for (int p = 0; p < num_nodes; p++) {
+	int v = ch->node_at[p];
+	for (const Arc &a : out[v]) {
+	  ch->up_head.push_back(ch->position_of[a.node]);
+	  ch->up_weight.push_back(a.weight);
+	}
+	for (const Arc &a : in[v]) {
+	  if (rank[v] < core_begin) {
+		ch->down_tail.push_back(ch->position_of[a.node]);
+		ch->down_weight.push_back(a.weight);
+	  }
+	}
+	ch->first_up.push_back(ch->up_head.size());
+	ch->first_down.push_back(ch->down_tail.size());
+  }
+  return ch;
+}
+
+class OneToAllRouterImpl {
+ public:
+  OneToAllRouterImpl(const StreetMap *sm);
+  ~OneToAllRouterImpl();
+  DeliveryResult distancesFrom(
+	  const MapSnapshot &snap,
+	  const vector<GeoCoord> &sources,
+	  vector<vector<double>> &dist) const;
+  DeliveryResult isochrones(
+	  const vector<GeoCoord> &sources,
+	  double maxDistance,
+	  vector<vector<GeoCoord>> &zones) const;
+ private:
+  static constexpr int kLanes = 8; //Sources swept together, each node's distances for them sit side by side
+  const StreetMap *map;
+  struct CachedHierarchy {
+	weak_ptr<const StreetGraph> graph;
+	weak_ptr<const EdgeMetric> metric;
+	shared_ptr<const ContractionHierarchy> hierarchy;
+  };
+  mutable shared_ptr<const vector<CachedHierarchy>> cache; //Only accessed through atomic_load/atomic_compare_exchange
+
+  shared_ptr<const ContractionHierarchy> hierarchyFor(const MapSnapshot &snap) const;
+  DeliveryResult sourcePositions(const MapSnapshot &snap, const ContractionHierarchy &ch, const vector<GeoCoord> &sources, vector<int> &positions) const;
+  void sweep(const ContractionHierarchy &ch, const int *sources, int count, double limit, vector<double> &dist) const;
+  template<typename Visit>
+  void sweepAll(const ContractionHierarchy &ch, const vector<int> &positions, double limit, Visit visit) const;
+};
+
+OneToAllRouterImpl::OneToAllRouterImpl(const StreetMap *sm) : map{sm} {
+}
+
+OneToAllRouterImpl::~OneToAllRouterImpl() {
+}
+
+//Building a hierarchy is the expensive part, so there's one cached for every metric still in use. A metric that's new
+//on a known graph reuses that graph's contraction order. Hierarchies are built without holding anything, so queries on
+//other snapshots never wait for one, and the cache is replaced as a whole by compare-and-swap. Two queries that miss
+//at once both build, and the later one's copy is the one kept.
+shared_ptr<const ContractionHierarchy> OneToAllRouterImpl::hierarchyFor(const MapSnapshot &snap) const {
+  shared_ptr<const ContractionHierarchy> same_graph;
+  shared_ptr<const vector<CachedHierarchy>> entries = atomic_load(&cache);
+  if (entries != nullptr) {
+	for (const auto &e : *entries) {
+	  if (e.graph.lock() == snap.graph) {
+		if (e.metric.lock() == snap.metric) {
+		  return e.hierarchy;
+		}
+		same_graph = e.hierarchy;
+	  }
+	}
+  }
+  HierarchyBuilder builder(*snap.graph, *snap.metric);
+  shared_ptr<const ContractionHierarchy> ch = same_graph != nullptr ? builder.build(*same_graph) : builder.build();
+
+  do { //Entries for graphs or metrics nobody holds any more are dropped on the way
+	auto next = make_shared<vector<CachedHierarchy>>();
+	if (entries != nullptr) {
+	  for (const auto &e : *entries) {
+		if (!e.graph.expired() && !e.metric.expired() && e.metric.lock() != snap.metric) {
+		  next->push_back(e);
+		}
+	  }
+	}
+	next->push_back({snap.graph, snap.metric, ch});
+	if (atomic_compare_exchange_weak(&cache, &entries, shared_ptr<const vector<CachedHierarchy>>(next))) {
+	  return ch;
+	}
+  } while (true);
+}
+
+DeliveryResult OneToAllRouterImpl::sourcePositions(const MapSnapshot &snap, const ContractionHierarchy &ch, const vector<GeoCoord> &sources, vector<int> &positions) const {
+  positions.clear();
+  for (const GeoCoord &g : sources) {
+	int v = snap.graph->nodeOf(g);
+	if (v < 0) {
+	  return BAD_COORD;
+	}
+	positions.push_back(ch.position_of[v]);
+  }
+  return DELIVERY_SUCCESS;
+}
+
+//PHAST: a Dijkstra search up the hierarchy from each source finds the distance to every node on the climbing part of
+//a shortest path, then one pass over the nodes in decreasing rank pulls distances down the down edges. Every node's
+//down edges come from more important nodes, which the pass has already finished. dist[position * kLanes + lane] gets
+//the distance from sources[lane]; the inner loop runs across the lanes so it compiles to vector instructions. Search
+//frontiers beyond limit are dropped, which leaves every distance up to limit exact.
+void OneToAllRouterImpl::sweep(const ContractionHierarchy &ch, const int *sources, int count, double limit, vector<double> &dist) const {
+  dist.assign((size_t) ch.numNodes() * kLanes, numeric_limits<double>::infinity());
+  for (int lane = 0; lane < count; lane++) {
+	priority_queue<pair<double, int>, vector<pair<double, int>>, greater<>> open_list;
+	dist[(size_t) sources[lane] * kLanes + lane] = 0;
+	open_list.push({0, sources[lane]});
+	while (!open_list.empty()) {
+	  pair<double, int> top = open_list.top();
+	  open_list.pop();
+	  if (top.first > dist[(size_t) top.second * kLanes + lane]) { //Stale entry
+		continue;
+	  }
+	  for (int e = ch.first_up[top.second]; e < ch.first_up[top.second + 1]; e++) {
+		double d = top.first + ch.up_weight[e];
+		double &known = dist[(size_t) ch.up_head[e] * kLanes + lane];
+		if (d < known && d <= limit) {
+		  known = d;
+		  open_list.push({d, ch.up_head[e]});
+		}
+	  }
+	}
+  }
+  for (int p = 0; p < ch.numNodes(); p++) {
+	double best[kLanes]; //A local copy can't alias the rows being read, so it stays in vector registers
+	copy(&dist[(size_t) p * kLanes], &dist[(size_t) (p + 1) * kLanes], best);
+	for (int e = ch.first_down[p]; e < ch.first_down[p + 1]; e++) {
+	  const double *from = &dist[(size_t) ch.down_tail[e] * kLanes];
+	  double w = ch.down_weight[e];
+#pragma GCC unroll 1 //Fully unrolled, the lanes would be handled one at a time instead of as vectors
+	  for (int lane = 0; lane < kLanes; lane++) {
+		double via = from[lane] + w;
+		best[lane] = via < best[lane] ? via : best[lane];
+	  }
+	}
+	copy(best, best + kLanes, &dist[(size_t) p * kLanes]);
+  }
+}
+
+//Sweeps the sources in groups of kLanes, groups in parallel, and calls visit(source index, distances, lane) for each
+//source with its group's distance array
+template<typename Visit>
+void OneToAllRouterImpl::sweepAll(const ContractionHierarchy &ch, const vector<int> &positions, double limit, Visit visit) const {
+  size_t groups = (positions.size() + kLanes - 1) / kLanes;
+  parallelFor(groups, [&](size_t begin, size_t end) {
+	vector<double> dist;
+	for (size_t group = begin; group < end; group++) {
+	  size_t first = group * kLanes;
+	  int count = (int) min<size_t>(kLanes, positions.size() - first);
+	  sweep(ch, &positions[first], count, limit, dist);
+	  for (int lane = 0; lane < count; lane++) {
+		visit(first + lane, dist, lane);
+	  }
+	}
+  });
+}
+
+DeliveryResult OneToAllRouterImpl::distancesFrom(const MapSnapshot &snap, const vector<GeoCoord> &sources, vector<vector<double>> &dist) const {
+  MemoryScope scope(MEM_ROUTER);
+  dist.clear();
+  shared_ptr<const ContractionHierarchy> ch = hierarchyFor(snap);
+  vector<int> positions;
+  if (sourcePositions(snap, *ch, sources, positions) != DELIVERY_SUCCESS) {
+	return BAD_COORD;
+  }
+  dist.resize(sources.size());
+  sweepAll(*ch, positions, numeric_limits<double>::infinity(), [&](size_t i, const vector<double> &lanes, int lane) {
+	dist[i].resize(ch->numNodes());
+	for (int p = 0; p < ch->numNodes(); p++) { //Back to node ids
+	  dist[i][ch->node_at[p]] = lanes[(size_t) p * kLanes + lane];
+	}
+  });
+  return DELIVERY_SUCCESS;
+}
+
+DeliveryResult OneToAllRouterImpl::isochrones(const vector<GeoCoord> &sources, double maxDistance, vector<vector<GeoCoord>> &zones) const {
+  MemoryScope scope(MEM_ROUTER);
+  zones.clear();
+  shared_ptr<const MapSnapshot> snap = mapSnapshot(*map); //Pin the map so a concurrent change can't affect this query
+  if (snap == nullptr) {
+	return BAD_COORD;
+  }
+  shared_ptr<const ContractionHierarchy> ch = hierarchyFor(*snap);
+  vector<int> positions;
+  if (sourcePositions(*snap, *ch, sources, positions) != DELIVERY_SUCCESS) {
+	return BAD_COORD;
+  }
+  zones.resize(sources.size());
+  sweepAll(*ch, positions, maxDistance, [&](size_t i, const vector<double> &lanes, int lane) {
+	for (int v = 0; v < ch->numNodes(); v++) {
+	  if (lanes[(size_t) ch->position_of[v] * kLanes + lane] <= maxDistance) {
+		zones[i].push_back(snap->graph->coords[v]);
+	  }
+	}
+  });
+  return DELIVERY_SUCCESS;
+}
+
+//******************** OneToAllRouter functions *******************************
+
+// These functions simply delegate to OneToAllRouterImpl's functions.
+
+OneToAllRouter::OneToAllRouter(const StreetMap *sm) {
+  m_impl = new OneToAllRouterImpl(sm);
+}
+
+OneToAllRouter::~OneToAllRouter() {
+  delete m_impl;
+}
+
+DeliveryResult OneToAllRouter::distancesFrom(
+	const MapSnapshot &map,
+	const vector<GeoCoord> &sources,
+	vector<vector<double>> &dist) const {
+  return m_impl->distancesFrom(map, sources, dist);
+}
+
+DeliveryResult OneToAllRouter::isochrones(
+	const vector<GeoCoord> &sources,
+	double maxDistance,
+	vector<vector<GeoCoord>> &zones) const {
+  return m_impl->isochrones(sources, maxDistance, zones);
+}
+
+DeliveryResult OneToAllRouter::isochrone(const GeoCoord &source, double maxDistance, vector<GeoCoord> &zone) const {
+  vector<vector<GeoCoord>> zones;
+  DeliveryResult result = m_impl->isochrones({source}, maxDistance, zones);
+  zone = zones.empty() ? vector<GeoCoord>() : zones[0];
+  return result;
+}
@@ -0,0 +1,65 @@
+#ifndef P4A_PARALLELFOR_H
+#define P4A_PARALLELFOR_H
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include "MemoryAccounting.h"
+
+inline size_t workerCount() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+//Splits [0, n) into one contiguous range per worker and calls body(begin, end) for each range, the calling thread
+//takes the first range. Ranges are disjoint so body only needs to synchronize access to shared state it writes.
+//Workers charge their allocations to the caller's memory subsystem.
+template<typename Body>
+void parallelFor(size_t n, Body body, size_t min_per_worker = 1) {
+  size_t workers = std::min(workerCount(), std::max<size_t>(1, n / std::max<size_t>(1, min_per_worker)));
+  std::vector<std::thread> threads;
+  MemorySubsystem subsystem = activeMemorySubsystem();
+  for (size_t w = 1; w < workers; w++) {
+	threads.emplace_back([&body, w, workers, n, subsystem]() {
+	  MemoryScope scope(subsystem);
+	  body(w * n / workers, (w + 1) * n / workers);
+	});
+  }
+  body(0, n / workers);
+  for (auto &t : threads) {
+	t.join();
+  }
+}
+
+//Sorts each worker's share of v in parallel, then merges neighbouring runs pairwise (also in parallel) until one
+//sorted run is left
+template<typename T, typename Compare>
+void parallelSort(std::vector<T> &v, Compare comp) {
+  size_t workers = std::min(workerCount(), std::max<size_t>(1, v.size() / 4096));
+  std::vector<size_t> bounds;
+  for (size_t w = 0; w <= workers; w++) {
+	bounds.push_back(w * v.size() / workers);
+  }
+  parallelFor(workers, [&](size_t begin, size_t end) {
+	for (size_t w = begin; w < end; w++) {
+	  std::sort(v.begin() + bounds[w], v.begin() + bounds[w + 1], comp);
+	}
+  });
+  while (bounds.size() > 2) {
+	size_t merges = (bounds.size() - 1) / 2;
+	parallelFor(merges, [&](size_t begin, size_t end) {
+	  for (size_t m = begin; m < end; m++) {
+		std::inplace_merge(v.begin() + bounds[2 * m], v.begin() + bounds[2 * m + 1], v.begin() + bounds[2 * m + 2], comp);
+	  }
+	});
+	std::vector<size_t> merged;
+	for (size_t i = 0; i < bounds.size(); i += 2) {
+	  merged.push_back(bounds[i]);
+	}
+	if (merged.back() != bounds.back()) {
+	  merged.push_back(bounds.back());
+	}
+	bounds = merged;
+  }
+}
+
+#endif //P4A_PARALLELFOR_H
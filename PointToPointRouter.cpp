@@ -1,8 +1,13 @@
 #include "provided.h"
-#include "ExpandableHashMap.h"
+#include "RouterApi.h"
+#include "StreetGraph.h"
+#include "MemoryAccounting.h"
+#include "StageTiming.h"
 #include <list>
 #include <queue>
 #include <vector>
+#include <memory>
+#include <memory_resource>
 using namespace std;
 
 class PointToPointRouterImpl {
@@ -14,6 +19,12 @@ class PointToPointRouterImpl {
 	  const GeoCoord &end,
 	  list<StreetSegment> &route,
 	  double &totalDistanceTravelled) const;
+  DeliveryResult generatePointToPointRoute(
+	  const MapSnapshot &snap,
+	  const GeoCoord &start,
+	  const GeoCoord &end,
+	  list<StreetSegment> &route,
+	  double &totalDistanceTravelled) const;
  private:
   const StreetMap *map;
 };
@@ -25,67 +36,172 @@ PointToPointRouterImpl::~PointToPointRouterImpl() {
 }
 
 DeliveryResult PointToPointRouterImpl::generatePointToPointRoute(const GeoCoord &start, const GeoCoord &end, list<StreetSegment> &route, double &totalDistanceTravelled) const {
+  shared_ptr<const MapSnapshot> snap = mapSnapshot(*map); //Pin the map so a concurrent change can't affect this search
+  if (snap == nullptr) {
+	route.clear();
+	return BAD_COORD;
+  }
+  return generatePointToPointRoute(*snap, start, end, route, totalDistanceTravelled);
+}
+
+//One end of a route that lies inside a chain: the part of an arc between the stop and one of the chain's junctions
+struct ChainEnd {
+  int junction;
+  int arc; //-1 when the stop is the junction itself
+  int begin; //Edges begin .. end - 1 of the arc
+  int end;
+  double cost;
+};
+
+//A* over the arcs between junctions. A start or end in the middle of a chain splits it: the search starts from the
+//junctions at both ends of the start's chain and can finish from either end of the destination's chain, or go straight
+//along the chain when both are on the same one.
+DeliveryResult PointToPointRouterImpl::generatePointToPointRoute(const MapSnapshot &snap, const GeoCoord &start, const GeoCoord &end, list<StreetSegment> &route, double &totalDistanceTravelled) const {
+  MemoryScope scope(MEM_ROUTER);
+  StageTimer stage(STAGE_ROUTE);
   route.clear(); //Make sure route is empty before we start
 
-  vector<StreetSegment> valid;
-  if (!map->getSegmentsThatStartWith(start, valid) || !map->getSegmentsThatStartWith(end, valid)) {
+  const StreetGraph *graph = snap.graph.get();
+  const EdgeMetric *metric = snap.metric.get();
+  int source = graph->nodeOf(start);
+  int target = graph->nodeOf(end);
+  if (source < 0 || target < 0) {
 	return BAD_COORD; //If the start or end coords aren't in our mapping data, we can't do anything so return BAD_COORD
   }
+  if (source == target) {
+	totalDistanceTravelled = 0;
+	return DELIVERY_SUCCESS;
+  }
+  if (metric->component[source] != metric->component[target]) { //No search could connect them
+	return NO_ROUTE;
+  }
 
-  ExpandableHashMap<GeoCoord, double> cost_map; //Records the distance traveled to reach a given GeoCoord
-
-  ExpandableHashMap<GeoCoord, StreetSegment> history; //Associated a GeoCoord with the StreetSeg taken to reach it
-  // (ending at that GeoCoord, starting at another)
+  auto partCost = [&](int a, int begin, int end) { //Weight of edges begin .. end - 1 of arc a
+	double cost = 0;
+	for (int i = graph->first_arc_edge[a] + begin; i < graph->first_arc_edge[a] + end; i++) {
+	  cost += metric->weight[graph->arc_edges[i]];
+	}
+	return cost;
+  };
+  //Where the search starts from (leaving the source along a part of an arc) and where it can finish (arriving at the
+  //target along a part of an arc). A junction is its own start or finish.
+  pmr::vector<ChainEnd> starts(requestMemory()), finishes(requestMemory());
+  int source_arc = graph->node_arc[source];
+  int target_arc = graph->node_arc[target];
+  if (source_arc < 0) {
+	starts.push_back({source, -1, 0, 0, 0});
+  } else {
+	int len = graph->arcLength(source_arc);
+	int k = graph->node_offset[source];
+	int back = graph->arc_reverse[source_arc];
+	starts.push_back({graph->arc_head[source_arc], source_arc, k, len, partCost(source_arc, k, len)});
+	starts.push_back({graph->arc_head[back], back, len - k, len, partCost(back, len - k, len)});
+  }
+  if (target_arc < 0) {
+	finishes.push_back({target, -1, 0, 0, 0});
+  } else {
+	int len = graph->arcLength(target_arc);
+	int k = graph->node_offset[target];
+	int back = graph->arc_reverse[target_arc];
+	finishes.push_back({graph->arc_tail[target_arc], target_arc, 0, k, partCost(target_arc, 0, k)});
+	finishes.push_back({graph->arc_tail[back], back, 0, len - k, partCost(back, 0, len - k)});
+  }
 
-  priority_queue<std::pair<double, GeoCoord>, vector<std::pair<double, GeoCoord>>, greater<>> open_list; //Contains GeoCoords sorted by their
-  // approximated cost so we can be efficient in looking at potential StreetSegs that will get us closer to the dest
+  ChainEnd direct{-1, -1, 0, 0, EdgeMetric::closed()}; //Along the chain without passing a junction, if both are on the same one
+  if (source_arc >= 0 && source_arc == target_arc) {
+	int len = graph->arcLength(source_arc);
+	int ks = graph->node_offset[source];
+	int kt = graph->node_offset[target];
+	if (ks < kt) {
+	  direct = {-1, source_arc, ks, kt, partCost(source_arc, ks, kt)};
+	} else {
+	  int back = graph->arc_reverse[source_arc];
+	  direct = {-1, back, len - ks, len - kt, partCost(back, len - ks, len - kt)};
+	}
+  }
 
-  open_list.push({0, start}); //We start looking from the start location
-  cost_map.associate(start, 0); //The cost to go from start -> start is zero
-  bool success = false;
+  //Search state comes from the request's memory, so the legs of a plan reuse the same blocks
+  pmr::vector<double> cost_map(graph->numNodes(), EdgeMetric::closed(), requestMemory()); //Records the cost of the cheapest known way to reach each junction
+  pmr::vector<int> history(graph->numNodes(), -1, requestMemory()); //The arc taken to reach each junction, or -2 - i if it was reached from starts[i]
+  pmr::vector<bool> settled(graph->numNodes(), false, requestMemory());
+
+  priority_queue<std::pair<double, int>, pmr::vector<std::pair<double, int>>, greater<>> open_list{greater<>(), pmr::vector<std::pair<double, int>>(requestMemory())};
+  //Contains junctions sorted by their approximated cost so we can be efficient in looking at potential arcs that will
+  //get us closer to the dest
+  auto approx = [&](int v, double cost) {
+	//Add the known cost to reach the node and approximate the cost to the destination from the crow distance.
+	//heuristic_scale is the cheapest cost per mile in the metric, so this never overestimates.
+	return cost + distanceEarthMiles(graph->coords[v], end) * metric->heuristic_scale;
+  };
+  for (size_t i = 0; i < starts.size(); i++) {
+	int j = starts[i].junction;
+	if (starts[i].cost < cost_map[j]) {
+	  cost_map[j] = starts[i].cost;
+	  history[j] = starts[i].arc < 0 ? -1 : -2 - (int) i;
+	  open_list.push({approx(j, starts[i].cost), j});
+	}
+  }
 
-  while (!open_list.empty()) { //Run until we've run out of potential GeoCoords to look at
-	GeoCoord current = open_list.top().second;
+  double best = direct.cost; //Cheapest complete route found so far
+  const ChainEnd *best_finish = &direct;
+  while (!open_list.empty() && open_list.top().first < best) { //Nothing left in the queue can lead to a cheaper route
+	int current = open_list.top().second;
 	open_list.pop();
-
-	if (current == end) { //We've reached the destination
-	  success = true;
-	  break;
+	if (settled[current]) { //Already expanded through a cheaper entry
+	  continue;
+	}
+	settled[current] = true;
+	for (const auto &finish : finishes) {
+	  if (finish.junction == current && cost_map[current] + finish.cost < best) {
+		best = cost_map[current] + finish.cost;
+		best_finish = &finish;
+	  }
 	}
 
-	vector<StreetSegment> options;
-	map->getSegmentsThatStartWith(current, options); //Get all StreetSegs that start at the current GeoCoord
-	for (const auto &next_seg : options) {
-	  auto next = next_seg.end;
-	  //The cost to reach the new GeoCoord is the cost to get to the current coord plus the distance of that StreetSeg
-	  double new_cost = *cost_map.find(current) + distanceEarthMiles(next_seg.start, next);
-	  if (cost_map.find(next) == nullptr || new_cost < *cost_map.find(next)) { //if we haven't come across the coord or the path taken to it has a lower cost than before
-		//Map the GeoCoord to the cost required to reach it
-		cost_map.associate(next, new_cost);
-		//Add the known cost to reach the new GeoCoord and approximate the distance to the destination using the 'euclidean' dist
-		double approx_cost = new_cost + distanceEarthMiles(next, end);
-		//Add to open list to be later looked at if necessary
-		open_list.push({approx_cost, next});
-		//Associate the new coord with the StreetSeg linking it and the 'current' GeoCoord so we can retrace the path later
-		history.associate(next, next_seg);
+	for (int a = graph->first_arc[current]; a < graph->first_arc[current + 1]; a++) { //All arcs that start at the current junction
+	  if (metric->arc_weight[a] == EdgeMetric::closed()) {
+		continue;
+	  }
+	  int next = graph->arc_head[a];
+	  //The cost to reach the new junction is the cost to get to the current one plus the weight of that arc
+	  double new_cost = cost_map[current] + metric->arc_weight[a];
+	  if (new_cost < cost_map[next]) { //if we haven't come across the junction or the path taken to it has a lower cost than before
+		cost_map[next] = new_cost;
+		history[next] = a;
+		open_list.push({approx(next, new_cost), next});
 	  }
 	}
   }
 
-  if (!success) { //Indicates we ran out of GeoCoords to look at without reaching the dest so we couldn't find a route to the destination
+  if (best == EdgeMetric::closed()) { //Indicates we ran out of junctions to look at without reaching the dest so we couldn't find a route to the destination
 	return NO_ROUTE;
   }
 
-  GeoCoord lastGeoCoord = end; //Start at the destination
-  totalDistanceTravelled = 0;
-  while (true) {
-	if (lastGeoCoord == start || history.find(lastGeoCoord) == nullptr) {
-	  break; //Once we reach the start coord (or if our came_from mapping got corrupted somehow which should never happen), we are done.
+  pmr::vector<int> edges(requestMemory()); //Edges of the route from the destination back to the start
+  auto addBackwards = [&](int a, int begin, int end) {
+	for (int i = graph->first_arc_edge[a] + end - 1; i >= graph->first_arc_edge[a] + begin; i--) {
+	  edges.push_back(graph->arc_edges[i]);
+	}
+  };
+  if (best_finish->arc >= 0) {
+	addBackwards(best_finish->arc, best_finish->begin, best_finish->end);
+  }
+  if (best_finish != &direct) {
+	int last = best_finish->junction; //Walk back through the arcs to the junction the search started from
+	while (history[last] >= 0) {
+	  int a = history[last];
+	  addBackwards(a, 0, graph->arcLength(a));
+	  last = graph->arc_tail[a];
+	}
+	if (history[last] <= -2) {
+	  const ChainEnd &first = starts[-2 - history[last]];
+	  addBackwards(first.arc, first.begin, first.end);
 	}
-	StreetSegment seg = (*history.find(lastGeoCoord)); //Finds the seg linking lastGeoCoord and the previous GeoCoord we traveled on
-	totalDistanceTravelled += distanceEarthMiles(seg.start, seg.end);
-	route.push_front(seg); //Always add to the front of the vector as we are going from the end of the path to the start
-	lastGeoCoord = seg.start;
+  }
+  totalDistanceTravelled = 0;
+  for (auto e = edges.rbegin(); e != edges.rend(); e++) {
+	totalDistanceTravelled += graph->edge_length[*e];
+	route.push_back(graph->segment(*e));
   }
   return DELIVERY_SUCCESS;
 }
@@ -110,3 +226,12 @@ DeliveryResult PointToPointRouter::generatePointToPointRoute(
 	double &totalDistanceTravelled) const {
   return m_impl->generatePointToPointRoute(start, end, route, totalDistanceTravelled);
 }
+
+DeliveryResult generatePointToPointRoute(
+	const MapSnapshot &map,
+	const GeoCoord &start,
+	const GeoCoord &end,
+	list<StreetSegment> &route,
+	double &totalDistanceTravelled) {
+  return PointToPointRouterImpl(nullptr).generatePointToPointRoute(map, start, end, route, totalDistanceTravelled); //Searching a pinned snapshot doesn't need the map
+}
@@ -0,0 +1,101 @@
+#ifndef P4A_ROUTEENCODING_H
+#define P4A_ROUTEENCODING_H
+
+#include <cmath>
+#include <cstdint>
+#include <list>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "provided.h"
+
+//Output stage for route geometry. A leg is written as the points it passes through: the start of its first segment
+//followed by the end of every segment.
+//
+//POLYLINE writes one line per leg in the encoded polyline format used by web map libraries (1e-5 degree precision).
+//BINARY writes the magic "DRR1" followed by one record per leg: a varint point count and then the zigzag varint
+//deltas of latitude and longitude in 1e-6 degrees from the previous point (the first point is relative to 0, 0).
+//Legs are written as they're handed over so a plan can be streamed without holding the whole output in memory.
+class RouteEncoder {
+ public:
+  enum Format { POLYLINE, BINARY };
+
+  RouteEncoder(std::ostream &out, Format format) : out{out}, format{format} {
+	if (format == BINARY) {
+	  out.write("DRR1", 4);
+	}
+  }
+
+  void writeLeg(const std::list<StreetSegment> &leg) {
+	std::vector<const GeoCoord *> points;
+	for (const auto &seg : leg) {
+	  if (points.empty()) {
+		points.push_back(&seg.start);
+	  }
+	  points.push_back(&seg.end);
+	}
+	if (format == POLYLINE) {
+	  out << encodePolyline(points) << '\n';
+	} else {
+	  std::string buf;
+	  appendVarint(buf, points.size());
+	  int64_t last_lat = 0, last_lon = 0;
+	  for (const GeoCoord *g : points) {
+		int64_t lat = std::llround(g->latitude * 1e6);
+		int64_t lon = std::llround(g->longitude * 1e6);
+		appendVarint(buf, zigzag(lat - last_lat));
+		appendVarint(buf, zigzag(lon - last_lon));
+		last_lat = lat;
+		last_lon = lon;
+	  }
+	  out.write(buf.data(), buf.size());
+	}
+  }
+
+  void writeLegs(const std::vector<std::list<StreetSegment>> &legs) {
+	for (const auto &leg : legs) {
+	  writeLeg(leg);
+	}
+  }
+
+  static std::string encodePolyline(const std::vector<const GeoCoord *> &points) {
+	std::string encoded;
+	int64_t last_lat = 0, last_lon = 0;
+	for (const GeoCoord *g : points) { //Each value is the difference from the previous point
+	  int64_t lat = std::llround(g->latitude * 1e5);
+	  int64_t lon = std::llround(g->longitude * 1e5);
+	  appendPolylineValue(encoded, lat - last_lat);
+	  appendPolylineValue(encoded, lon - last_lon);
+	  last_lat = lat;
+	  last_lon = lon;
+	}
+	return encoded;
+  }
+
+ private:
+  std::ostream &out;
+  Format format;
+
+  static uint64_t zigzag(int64_t v) { //Small negative numbers become small positive ones
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+  }
+
+  static void appendVarint(std::string &buf, uint64_t v) {
+	while (v >= 0x80) {
+	  buf += (char) ((v & 0x7f) | 0x80);
+	  v >>= 7;
+	}
+	buf += (char) v;
+  }
+
+  static void appendPolylineValue(std::string &buf, int64_t v) { //5 bits per character, 0x20 marks that more follow
+	uint64_t u = v < 0 ? ~((uint64_t) v << 1) : (uint64_t) v << 1;
+	while (u >= 0x20) {
+	  buf += (char) ((0x20 | (u & 0x1f)) + 63);
+	  u >>= 5;
+	}
+	buf += (char) (u + 63);
+  }
+};
+
+#endif //P4A_ROUTEENCODING_H
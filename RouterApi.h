@@ -0,0 +1,147 @@
+#ifndef P4A_ROUTERAPI_H
+#define P4A_ROUTERAPI_H
+
+// Everything the router offers beyond the original project interface in
+// provided.h, which stays exactly as it was handed out.  Its classes can't
+// grow new members, so the additions are free functions that take the
+// provided objects, and new types.
+
+#include <functional>
+#include <limits>
+#include <list>
+#include <memory>
+#include <vector>
+#include "provided.h"
+
+struct MapSnapshot;
+
+  // Replace the cost the router minimizes on every segment (travel time, a
+  // congestion multiplier, ...).  weightOf gets each directed segment and its
+  // length in miles; returning infinity closes the segment.  Only the weight
+  // array is rebuilt, so this is cheap enough to call on every traffic update.
+  // Distances reported by the router are always in miles.
+void setEdgeWeights(StreetMap& sm, const std::function<double(const StreetSegment& seg, double lengthMiles)>& weightOf);
+  // Go back to routing on segment length.
+void resetEdgeWeights(StreetMap& sm);
+  // Ad-hoc edits on top of the map file.  They are kept across reloads.
+  // closeSegment closes both directions and returns false if there is no
+  // such segment.
+bool closeSegment(StreetMap& sm, const GeoCoord& start, const GeoCoord& end);
+void reopenSegment(StreetMap& sm, const GeoCoord& start, const GeoCoord& end);
+void addSegment(StreetMap& sm, const StreetSegment& seg);
+void clearOverlay(StreetMap& sm);
+  // Every change to the map (load, edge weights, overlay edits) publishes a
+  // new immutable snapshot.  Pin the current one for the duration of a
+  // request; it stays valid however the map changes in the meantime, so
+  // load() and the edits above are safe while other threads are routing.
+  // Null until a map has been loaded.
+std::shared_ptr<const MapSnapshot> mapSnapshot(const StreetMap& sm);
+
+  // PointToPointRouter::generatePointToPointRoute on a snapshot the caller
+  // has pinned.
+DeliveryResult generatePointToPointRoute(
+    const MapSnapshot& map,
+    const GeoCoord& start,
+    const GeoCoord& end,
+    std::list<StreetSegment>& route,
+    double& totalDistanceTravelled);
+
+class OneToAllRouterImpl;
+
+  // Distances from a source to every node of the map at once, for service
+  // areas and zones.  Queries sweep a contraction hierarchy of the map that is
+  // built on first use and reused until the map or its edge weights change.
+  // Distances are in whatever the router minimizes (miles unless
+  // setEdgeWeights changed it); unreachable nodes get infinity.  Returns
+  // BAD_COORD if a source isn't a node of the map.
+class OneToAllRouter
+{
+public:
+    OneToAllRouter(const StreetMap* sm);
+    ~OneToAllRouter();
+      // dist[i][v] is the distance from sources[i] to node v of the pinned map
+      // (its GeoCoord is map.graph->coords[v]).  Sources are swept several at
+      // a time, so one call with many sources is much cheaper than many calls.
+    DeliveryResult distancesFrom(
+        const MapSnapshot& map,
+        const std::vector<GeoCoord>& sources,
+        std::vector<std::vector<double>>& dist) const;
+      // zones[i] gets every node within maxDistance of sources[i].
+    DeliveryResult isochrones(
+        const std::vector<GeoCoord>& sources,
+        double maxDistance,
+        std::vector<std::vector<GeoCoord>>& zones) const;
+    DeliveryResult isochrone(
+        const GeoCoord& source,
+        double maxDistance,
+        std::vector<GeoCoord>& zone) const;
+      // We prevent a OneToAllRouter object from being copied or assigned.
+    OneToAllRouter(const OneToAllRouter&) = delete;
+    OneToAllRouter& operator=(const OneToAllRouter&) = delete;
+private:
+    OneToAllRouterImpl* m_impl;
+};
+
+  // Optional time window for one delivery, in minutes after the vehicle
+  // leaves the depot.  Arriving before windowStart means waiting; the stop
+  // should be reached by windowEnd.  serviceMinutes is the time spent at the
+  // stop.
+struct StopSchedule
+{
+    double windowStart = 0;
+    double windowEnd = std::numeric_limits<double>::infinity();
+    double serviceMinutes = 0;
+    bool hasTimeWindow() const
+    {
+        return windowStart > 0 || windowEnd < std::numeric_limits<double>::infinity();
+    }
+};
+
+  // Tuning for a single plan.
+struct PlanOptions
+{
+      // Wall-clock budget in seconds for optimizing the delivery order, 0 for
+      // no limit.  When it runs out the optimizer keeps the best order found so
+      // far; routing the final legs is not included.
+    double timeBudgetSeconds = 0;
+      // Average driving speed, used to turn road distances into travel times
+      // when a manifest has time windows.
+    double milesPerHour = 25;
+};
+
+  // DeliveryOptimizer::optimizeDeliveryOrder on a snapshot the caller has
+  // pinned.  schedules is either empty or has one entry per delivery, and is
+  // reordered along with deliveries.  oldDistance and newDistance are the tour
+  // lengths (depot, stops, depot) of the original and the returned order.
+  // Without a time budget they are road distances and distancesExact is set.
+  // With one, legs that weren't routed before the deadline count their crow
+  // distance, which is never more than their road distance, and distancesExact
+  // says whether there were none.  A leg with no route counts as 1,000,000
+  // miles.
+void optimizeDeliveryOrder(
+    const MapSnapshot& map,
+    const GeoCoord& depot,
+    std::vector<DeliveryRequest>& deliveries,
+    std::vector<StopSchedule>& schedules,
+    double& oldDistance,
+    double& newDistance,
+    bool& distancesExact,
+    const PlanOptions& options = PlanOptions());
+
+  // DeliveryPlanner::generateDeliveryPlan with stop schedules (empty or one
+  // per delivery) and options.  It also returns the street segments of every
+  // leg in travel order (depot to the first stop, ..., last stop to the
+  // depot), and if the result is NO_ROUTE lists which stops (as indexes into
+  // deliveries) can't be reached from the depot or can't get back to it.
+DeliveryResult generateDeliveryPlan(
+    const StreetMap& sm,
+    const GeoCoord& depot,
+    const std::vector<DeliveryRequest>& deliveries,
+    const std::vector<StopSchedule>& schedules,
+    std::vector<DeliveryCommand>& commands,
+    double& totalDistanceTravelled,
+    std::vector<std::list<StreetSegment>>& legs,
+    std::vector<size_t>& unreachable,
+    const PlanOptions& options = PlanOptions());
+
+#endif //P4A_ROUTERAPI_H
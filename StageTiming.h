@@ -0,0 +1,69 @@
+#ifndef P4A_STAGETIMING_H
+#define P4A_STAGETIMING_H
+
+#include <chrono>
+
+//Wall-clock time of a request split by pipeline stage. Time on a thread is charged to the StageTimer that opened most
+//recently on it, so stages don't overlap: routing done while optimizing counts as routing, not optimizing. Totals are
+//kept per thread (worker threads a stage starts aren't included), read and reset them around a request.
+enum PlanStage {
+  STAGE_OTHER,
+  STAGE_CHECK, //Validating the manifest and finding stops that can't be reached
+  STAGE_OPTIMIZE, //Ordering the stops, apart from the routes it asks for
+  STAGE_ROUTE, //Point-to-point searches
+  STAGE_DIRECTIONS, //Turning the legs into commands
+  STAGE_NUM_STAGES
+};
+
+struct StageTimes {
+  double seconds[STAGE_NUM_STAGES] = {};
+};
+
+inline thread_local StageTimes stage_totals;
+inline thread_local PlanStage stage_active = STAGE_OTHER;
+inline thread_local std::chrono::steady_clock::time_point stage_since = std::chrono::steady_clock::now();
+
+inline void switchStage(PlanStage next) { //Charges the time since the last switch to the active stage
+  auto now = std::chrono::steady_clock::now();
+  stage_totals.seconds[stage_active] += std::chrono::duration<double>(now - stage_since).count();
+  stage_since = now;
+  stage_active = next;
+}
+
+inline StageTimes stageTimes() {
+  switchStage(stage_active);
+  return stage_totals;
+}
+
+inline void resetStageTimes() {
+  switchStage(stage_active);
+  stage_totals = StageTimes();
+}
+
+inline const char *stageName(PlanStage s) {
+  switch (s) {
+	case STAGE_OTHER: return "other";
+	case STAGE_CHECK: return "check";
+	case STAGE_OPTIMIZE: return "optimize";
+	case STAGE_ROUTE: return "route";
+	case STAGE_DIRECTIONS: return "directions";
+	default: return "?";
+  }
+}
+
+//Charges time on this thread to a stage until the scope ends. Timers nest.
+class StageTimer {
+ public:
+  explicit StageTimer(PlanStage s) : previous{stage_active} {
+	switchStage(s);
+  }
+  ~StageTimer() {
+	switchStage(previous);
+  }
+  StageTimer(const StageTimer &) = delete;
+  StageTimer &operator=(const StageTimer &) = delete;
+ private:
+  PlanStage previous;
+};
+
+#endif //P4A_STAGETIMING_H
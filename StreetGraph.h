@@ -0,0 +1,92 @@
+#ifndef P4A_STREETGRAPH_H
+#define P4A_STREETGRAPH_H
+
+#include <vector>
+#include <string>
+#include <limits>
+#include <memory>
+#include <utility>
+#include "provided.h"
+#include "ExpandableHashMap.h"
+
+//Compact routing index built from the map data. Every GeoCoord gets a node id and the segments leaving a node are
+//stored contiguously (edges first_edge[v] .. first_edge[v + 1] - 1). The graph only holds topology and geometry, the
+//costs the router minimizes live in a separate EdgeMetric so they can be swapped without rebuilding the graph.
+struct StreetGraph {
+  std::vector<GeoCoord> coords; //Node id -> GeoCoord
+  std::vector<int> first_edge; //Node id -> index of its first outgoing edge, has one extra entry at the end
+  std::vector<int> edge_tail; //Edge id -> node the segment starts at
+  std::vector<int> edge_head; //Edge id -> node the segment ends at
+  std::vector<int> edge_name; //Edge id -> index into names
+  std::vector<double> edge_length; //Edge id -> length of the segment in miles
+  std::vector<std::string> names;
+  ExpandableHashMap<GeoCoord, int> node_ids;
+
+  //Degree-2 chains. A node whose only neighbours are two other nodes, with one edge each way to each, is interior to
+  //a chain and every other node is a junction. The router searches arcs, one for each direction of every chain between
+  //two junctions, and each arc keeps its edges in travel order so a route over arcs unpacks to the original segments.
+  std::vector<int> first_arc; //Node id -> index of its first outgoing arc (interior nodes have none), has one extra entry at the end
+  std::vector<int> arc_tail; //Arc id -> junction the arc starts at
+  std::vector<int> arc_head; //Arc id -> junction the arc ends at
+  std::vector<int> arc_reverse; //Arc id -> the same chain in the other direction, -1 for an arc without interior nodes
+  std::vector<int> first_arc_edge; //Arc id -> index of its first edge in arc_edges, has one extra entry at the end
+  std::vector<int> arc_edges;
+  std::vector<int> node_arc; //Node id -> arc the node is interior to, -1 for junctions
+  std::vector<int> node_offset; //Node id -> number of node_arc's edges before the node
+
+  int numNodes() const {
+	return (int) coords.size();
+  }
+
+  int numEdges() const {
+	return (int) edge_head.size();
+  }
+
+  int numArcs() const {
+	return (int) arc_head.size();
+  }
+
+  int arcLength(int a) const { //Number of edges in the arc
+	return first_arc_edge[a + 1] - first_arc_edge[a];
+  }
+
+  int nodeOf(const GeoCoord &g) const { //Returns -1 if the GeoCoord isn't in the map
+	const int *id = node_ids.find(g);
+	return id == nullptr ? -1 : *id;
+  }
+
+  StreetSegment segment(int e) const {
+	return {coords[edge_tail[e]], coords[edge_head[e]], names[edge_name[e]]};
+  }
+};
+
+//One set of edge costs for a StreetGraph. A weight of infinity closes the edge.
+struct EdgeMetric {
+  std::vector<double> weight; //Edge id -> cost of traversing the edge
+  std::vector<double> arc_weight; //Arc id -> total weight of the arc's edges, so closed if any of them is
+  std::vector<int> component; //Node id -> connected component over open edges ignoring direction, nodes in different ones can't reach each other
+  std::vector<int> strong_component; //Node id -> strongly connected component over open edges, nodes in the same one can reach each other
+  double heuristic_scale = 1; //Lowest cost per mile of any edge, so scaling the crow distance by it keeps A* admissible
+  bool symmetric = false; //Every open edge has a reverse edge of the same weight, so any route costs the same both ways
+
+  static constexpr double closed() {
+	return std::numeric_limits<double>::infinity();
+  }
+};
+
+//Ad-hoc edits layered over the map file. They are kept apart from the file's data so they survive a reload.
+struct MapOverlay {
+  std::vector<StreetSegment> added; //Extra segments, routable in both directions
+  std::vector<std::pair<GeoCoord, GeoCoord>> closed; //Closed segments by their endpoints, both directions are closed
+};
+
+//Immutable view of the map. Every change to the map publishes a new snapshot and a request pins one for its whole
+//lifetime, so in-flight routing never sees a half-applied change.
+struct MapSnapshot {
+  unsigned long version = 0;
+  std::shared_ptr<const StreetGraph> graph; //Map file plus the overlay's added segments
+  std::shared_ptr<const EdgeMetric> metric; //Weights for graph's edges with the overlay's closures applied
+  std::shared_ptr<const MapOverlay> overlay;
+};
+
+#endif //P4A_STREETGRAPH_H
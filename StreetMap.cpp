@@ -1,13 +1,388 @@
 #include "provided.h"
+#include "RouterApi.h"
 #include <string>
+#include <string_view>
 #include <vector>
 #include <functional>
 #include <fstream>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
 #include "ExpandableHashMap.h"
+#include "StreetGraph.h"
+#include "HilbertCurve.h"
+#include "MemoryAccounting.h"
+#include "ParallelFor.h"
 using namespace std;
 
+static size_t hashCoordText(const GeoCoord &g) { //Hashes the two texts separately so looking a node up doesn't allocate
+  return std::hash<string>()(g.latitudeText) * 1000003 ^ std::hash<string>()(g.longitudeText);
+}
+
 unsigned int hasher(const GeoCoord &g) {
-  return std::hash<string>()(g.latitudeText + g.longitudeText);
+  return hashCoordText(g);
+}
+
+//A street segment waiting to be laid out. Segments from the map file are routable in both directions.
+struct PendingSegment {
+  GeoCoord start;
+  GeoCoord end;
+  int name;
+  bool both_ways;
+};
+
+//Collects street segments, then gives every distinct GeoCoord a node id and lays the edges out as a StreetGraph
+class StreetGraphBuilder {
+ public:
+  StreetGraphBuilder();
+  int addName(const string &name);
+  void addSegment(const GeoCoord &start, const GeoCoord &end, int name, bool both_ways);
+  void addSegments(vector<string> &names, vector<PendingSegment> &segs); //Takes the contents of both vectors
+  shared_ptr<const StreetGraph> build();
+ private:
+  unique_ptr<StreetGraph> g;
+  vector<PendingSegment> segments; //In the order they were added
+  vector<int> tails; //Directed edges by node id, in the order they were added
+  vector<int> heads;
+  vector<int> name_ids;
+  void assignNodeIds();
+  void renumberAlongHilbertCurve();
+  void compressChains();
+};
+
+StreetGraphBuilder::StreetGraphBuilder() : g{new StreetGraph} {
+}
+
+int StreetGraphBuilder::addName(const string &name) {
+  g->names.push_back(name);
+  return g->names.size() - 1;
+}
+
+void StreetGraphBuilder::addSegment(const GeoCoord &start, const GeoCoord &end, int name, bool both_ways) {
+  segments.push_back({start, end, name, both_ways});
+}
+
+void StreetGraphBuilder::addSegments(vector<string> &names, vector<PendingSegment> &segs) {
+  int offset = g->names.size();
+  for (auto &name : names) {
+	g->names.push_back(std::move(name));
+  }
+  for (auto &seg : segs) {
+	seg.name += offset;
+  }
+  if (segments.empty()) {
+	segments.swap(segs);
+  } else {
+	segments.insert(segments.end(), make_move_iterator(segs.begin()), make_move_iterator(segs.end()));
+  }
+  names.clear();
+  segs.clear();
+}
+
+shared_ptr<const StreetGraph> StreetGraphBuilder::build() {
+  assignNodeIds();
+  renumberAlongHilbertCurve();
+  for (int v = 0; v < g->numNodes(); v++) { //Only now that ids are final do we fill in the lookup table
+	g->node_ids.associate(g->coords[v], v);
+  }
+
+  //Lay the edges out grouped by the node they start at (a counting sort that keeps the order they were added in)
+  g->first_edge.assign(g->numNodes() + 1, 0);
+  for (int tail : tails) {
+	g->first_edge[tail + 1]++;
+  }
+  for (int v = 0; v < g->numNodes(); v++) {
+	g->first_edge[v + 1] += g->first_edge[v];
+  }
+  vector<int> slot(g->first_edge.begin(), g->first_edge.end() - 1);
+  g->edge_tail.resize(tails.size());
+  g->edge_head.resize(tails.size());
+  g->edge_name.resize(tails.size());
+  g->edge_length.resize(tails.size());
+  for (size_t i = 0; i < tails.size(); i++) {
+	int e = slot[tails[i]]++;
+	g->edge_tail[e] = tails[i];
+	g->edge_head[e] = heads[i];
+	g->edge_name[e] = name_ids[i];
+  }
+  parallelFor(g->edge_length.size(), [&](size_t begin, size_t end) {
+	for (size_t e = begin; e < end; e++) {
+	  g->edge_length[e] = distanceEarthMiles(g->coords[g->edge_tail[e]], g->coords[g->edge_head[e]]);
+	}
+  }, 4096);
+  compressChains();
+  return shared_ptr<const StreetGraph>(g.release());
+}
+
+//Finds the distinct GeoCoords by sorting a hash of every segment endpoint in parallel. Equal GeoCoords end up next
+//to each other, so ids can be handed out in one pass without a shared hash table. Endpoints whose hashes collide are
+//told apart by comparing their text.
+void StreetGraphBuilder::assignNodeIds() {
+  vector<pair<size_t, size_t>> keyed(2 * segments.size()); //(hash, endpoint) where endpoint 2i is segment i's start and 2i + 1 its end
+  auto endpoint = [this](size_t k) -> const GeoCoord & {
+	return k % 2 == 0 ? segments[k / 2].start : segments[k / 2].end;
+  };
+  parallelFor(keyed.size(), [&](size_t begin, size_t end) {
+	for (size_t k = begin; k < end; k++) {
+	  keyed[k] = {hashCoordText(endpoint(k)), k};
+	}
+  }, 4096);
+  parallelSort(keyed, less<pair<size_t, size_t>>());
+
+  vector<int> ids(keyed.size());
+  for (size_t run = 0; run < keyed.size();) {
+	size_t run_end = run;
+	int first_id = g->numNodes();
+	for (; run_end < keyed.size() && keyed[run_end].first == keyed[run].first; run_end++) {
+	  const GeoCoord &gc = endpoint(keyed[run_end].second);
+	  int id = first_id;
+	  while (id < g->numNodes() && g->coords[id] != gc) { //Almost always a single candidate
+		id++;
+	  }
+	  if (id == g->numNodes()) {
+		g->coords.push_back(gc);
+	  }
+	  ids[keyed[run_end].second] = id;
+	}
+	run = run_end;
+  }
+
+  for (size_t i = 0; i < segments.size(); i++) {
+	tails.push_back(ids[2 * i]);
+	heads.push_back(ids[2 * i + 1]);
+	name_ids.push_back(segments[i].name);
+	if (segments[i].both_ways) {
+	  tails.push_back(ids[2 * i + 1]);
+	  heads.push_back(ids[2 * i]);
+	  name_ids.push_back(segments[i].name);
+	}
+  }
+  vector<PendingSegment>().swap(segments); //Done with the coordinates, free them before the graph arrays are built
+}
+
+//Ids come out of assignNodeIds in hash order, which scatters neighbouring intersections across memory. Renumbering
+//the nodes in Hilbert curve order puts nodes that are close on the map close together in the node and edge arrays,
+//so most of what A* touches while expanding an area is already in cache.
+void StreetGraphBuilder::renumberAlongHilbertCurve() {
+  GeoBounds bounds;
+  for (const auto &gc : g->coords) {
+	bounds.extend(gc);
+  }
+  vector<pair<uint64_t, int>> order;
+  for (int v = 0; v < g->numNodes(); v++) {
+	order.emplace_back(bounds.hilbertIndexOf(g->coords[v]), v);
+  }
+  parallelSort(order, less<pair<uint64_t, int>>());
+
+  vector<int> new_id(g->numNodes());
+  vector<GeoCoord> coords(g->numNodes());
+  for (int v = 0; v < g->numNodes(); v++) {
+	new_id[order[v].second] = v;
+	coords[v] = std::move(g->coords[order[v].second]);
+  }
+  g->coords = std::move(coords);
+  for (size_t i = 0; i < tails.size(); i++) {
+	tails[i] = new_id[tails[i]];
+	heads[i] = new_id[heads[i]];
+  }
+}
+
+//Finds the junctions and walks every chain between them from both ends to lay out the arcs, grouped by the junction
+//they start at. A loop of interior nodes with no junction on it gets one of its nodes made a junction so it has arcs.
+void StreetGraphBuilder::compressChains() {
+  int n = g->numNodes();
+  vector<int> in_degree(n, 0);
+  for (int head : g->edge_head) {
+	in_degree[head]++;
+  }
+  auto hasEdge = [this](int from, int to) {
+	for (int e = g->first_edge[from]; e < g->first_edge[from + 1]; e++) {
+	  if (g->edge_head[e] == to) {
+		return true;
+	  }
+	}
+	return false;
+  };
+  vector<bool> junction(n);
+  for (int v = 0; v < n; v++) {
+	int e = g->first_edge[v];
+	bool interior = g->first_edge[v + 1] - e == 2 && in_degree[v] == 2;
+	if (interior) {
+	  int u = g->edge_head[e];
+	  int w = g->edge_head[e + 1];
+	  interior = u != w && u != v && w != v && hasEdge(u, v) && hasEdge(w, v);
+	}
+	junction[v] = !interior;
+  }
+  auto nextAlong = [this](int v, int prev) { //The edge leaving interior node v that doesn't go back to prev
+	int e = g->first_edge[v];
+	return g->edge_head[e] == prev ? e + 1 : e;
+  };
+
+  vector<bool> walked(n, false); //Walk each chain one way until it reaches a junction, or comes back around to where it started
+  for (int v = 0; v < n; v++) {
+	if (junction[v] || walked[v]) {
+	  continue;
+	}
+	walked[v] = true;
+	int prev = v;
+	int cur = g->edge_head[g->first_edge[v]];
+	while (!junction[cur] && !walked[cur]) {
+	  walked[cur] = true;
+	  int e = nextAlong(cur, prev);
+	  prev = cur;
+	  cur = g->edge_head[e];
+	}
+	if (cur == v) {
+	  junction[v] = true;
+	}
+  }
+
+  vector<int> arc_of_first_edge(g->numEdges(), -1);
+  g->node_arc.assign(n, -1);
+  g->node_offset.assign(n, 0);
+  g->first_arc.assign(n + 1, 0);
+  g->first_arc_edge.push_back(0);
+  for (int v = 0; v < n; v++) {
+	g->first_arc[v] = g->numArcs();
+	if (!junction[v]) {
+	  continue;
+	}
+	for (int e = g->first_edge[v]; e < g->first_edge[v + 1]; e++) {
+	  int a = g->numArcs();
+	  arc_of_first_edge[e] = a;
+	  g->arc_edges.push_back(e);
+	  int prev = v;
+	  int cur = g->edge_head[e];
+	  while (!junction[cur]) {
+		if (g->node_arc[cur] == -1) { //The first arc to pass through a chain records it for every interior node on it
+		  g->node_arc[cur] = a;
+		  g->node_offset[cur] = g->arc_edges.size() - g->first_arc_edge[a];
+		}
+		int next = nextAlong(cur, prev);
+		g->arc_edges.push_back(next);
+		prev = cur;
+		cur = g->edge_head[next];
+	  }
+	  g->arc_tail.push_back(v);
+	  g->arc_head.push_back(cur);
+	  g->first_arc_edge.push_back(g->arc_edges.size());
+	}
+  }
+  g->first_arc[n] = g->numArcs();
+
+  g->arc_reverse.assign(g->numArcs(), -1); //The reverse of an arc starts with the edge back from its head to its last interior node
+  for (int a = 0; a < g->numArcs(); a++) {
+	if (g->arcLength(a) > 1) {
+	  int last = g->edge_tail[g->arc_edges[g->first_arc_edge[a + 1] - 1]];
+	  int j = g->arc_head[a];
+	  for (int e = g->first_edge[j]; e < g->first_edge[j + 1]; e++) {
+		if (g->edge_head[e] == last) {
+		  g->arc_reverse[a] = arc_of_first_edge[e];
+		}
+	  }
+	}
+  }
+}
+
+//Fills in what the router derives from the edge weights: the weight of every arc (a closed edge closes its whole arc),
+//whether the weights are symmetric and the connected and strongly connected components of the open edges. Components
+//use union-find and an iterative Tarjan search, so even large maps don't need deep recursion.
+void deriveFromWeights(const StreetGraph &g, EdgeMetric &m) {
+  m.arc_weight.assign(g.numArcs(), 0);
+  for (int a = 0; a < g.numArcs(); a++) {
+	for (int i = g.first_arc_edge[a]; i < g.first_arc_edge[a + 1]; i++) {
+	  m.arc_weight[a] += m.weight[g.arc_edges[i]];
+	}
+  }
+
+  m.symmetric = true;
+  for (int e = 0; e < g.numEdges() && m.symmetric; e++) {
+	if (m.weight[e] == EdgeMetric::closed()) {
+	  continue;
+	}
+	bool reversed = false;
+	int head = g.edge_head[e];
+	for (int r = g.first_edge[head]; r < g.first_edge[head + 1] && !reversed; r++) {
+	  reversed = g.edge_head[r] == g.edge_tail[e] && m.weight[r] == m.weight[e];
+	}
+	m.symmetric = reversed;
+  }
+
+  int n = g.numNodes();
+  vector<int> parent(n);
+  for (int v = 0; v < n; v++) {
+	parent[v] = v;
+  }
+  auto root = [&parent](int v) {
+	while (parent[v] != v) {
+	  v = parent[v] = parent[parent[v]];
+	}
+	return v;
+  };
+  for (int e = 0; e < g.numEdges(); e++) {
+	if (m.weight[e] != EdgeMetric::closed()) {
+	  parent[root(g.edge_tail[e])] = root(g.edge_head[e]);
+	}
+  }
+  m.component.assign(n, -1);
+  int components = 0;
+  for (int v = 0; v < n; v++) {
+	int r = root(v);
+	if (m.component[r] == -1) {
+	  m.component[r] = components++;
+	}
+	m.component[v] = m.component[r];
+  }
+
+  m.strong_component.assign(n, -1);
+  vector<int> index(n, -1), low(n);
+  vector<int> stack; //Nodes visited but not yet assigned to a component
+  vector<pair<int, int>> calls; //Nodes being searched and the next edge each will look at
+  int next_index = 0;
+  int strong_components = 0;
+  for (int s = 0; s < n; s++) {
+	if (index[s] != -1) {
+	  continue;
+	}
+	index[s] = low[s] = next_index++;
+	stack.push_back(s);
+	calls.emplace_back(s, g.first_edge[s]);
+	while (!calls.empty()) {
+	  int v = calls.back().first;
+	  int e = calls.back().second;
+	  if (e < g.first_edge[v + 1]) {
+		calls.back().second++;
+		int w = g.edge_head[e];
+		if (m.weight[e] == EdgeMetric::closed()) {
+		  continue;
+		}
+		if (index[w] == -1) {
+		  index[w] = low[w] = next_index++;
+		  stack.push_back(w);
+		  calls.emplace_back(w, g.first_edge[w]);
+		} else if (m.strong_component[w] == -1) { //Still on the stack
+		  low[v] = min(low[v], index[w]);
+		}
+		continue;
+	  }
+	  if (low[v] == index[v]) { //v is the first node of its component that was visited, everything above it on the stack is in it
+		int w;
+		do {
+		  w = stack.back();
+		  stack.pop_back();
+		  m.strong_component[w] = strong_components;
+		} while (w != v);
+		strong_components++;
+	  }
+	  calls.pop_back();
+	  if (!calls.empty()) {
+		low[calls.back().first] = min(low[calls.back().first], low[v]);
+	  }
+	}
+  }
 }
 
 class StreetMapImpl {
@@ -16,12 +391,29 @@ class StreetMapImpl {
   ~StreetMapImpl();
   bool load(string mapFile);
   bool getSegmentsThatStartWith(const GeoCoord &gc, vector<StreetSegment> &segs) const;
+  void setEdgeWeights(const function<double(const StreetSegment &, double)> &weightOf);
+  void resetEdgeWeights();
+  bool closeSegment(const GeoCoord &start, const GeoCoord &end);
+  void reopenSegment(const GeoCoord &start, const GeoCoord &end);
+  void addSegment(const StreetSegment &seg);
+  void clearOverlay();
+  shared_ptr<const MapSnapshot> snapshot() const;
  private:
-  std::pair<GeoCoord, GeoCoord> get_geocoords(string s);
-  ExpandableHashMap<GeoCoord, vector<StreetSegment>> map;
+  std::pair<GeoCoord, GeoCoord> get_geocoords(string_view s) const;
+  shared_ptr<const StreetGraph> applyAdditions(const MapOverlay &ov) const;
+  shared_ptr<const EdgeMetric> computeMetric(const StreetGraph &g) const;
+  void publish(shared_ptr<const StreetGraph> g, shared_ptr<const EdgeMetric> raw, shared_ptr<const MapOverlay> ov);
+
+  mutex writer; //Serializes changes to the map, readers never take it
+  shared_ptr<const StreetGraph> file_graph; //The map file on its own
+  function<double(const StreetSegment &, double)> weight_fn; //Empty means route on length
+  shared_ptr<const EdgeMetric> raw_metric; //weight_fn over the current graph, before closures
+  shared_ptr<const MapOverlay> overlay;
+  shared_ptr<const MapSnapshot> current; //Only accessed through atomic_load/atomic_store
+  unsigned long version = 0;
 };
 
-StreetMapImpl::StreetMapImpl() {
+StreetMapImpl::StreetMapImpl() : overlay{make_shared<MapOverlay>()} {
 
 }
 
@@ -29,64 +421,267 @@ StreetMapImpl::~StreetMapImpl() {
 
 }
 
+//Where one street's record starts in the map file and how many segment lines follow its name and count lines
+struct StreetRecord {
+  size_t begin;
+  int num_segments;
+};
+
+//Reads the whole file into memory, finds where each street's record starts and then parses the records on all
+//cores. Every segment has a precomputed slot so the workers never share anything they write.
 bool StreetMapImpl::load(string mapFile) {
-  ifstream infile(mapFile);
+  MemoryScope scope(MEM_STREET_MAP);
+  ifstream infile(mapFile, ios::binary);
   if (!infile) { //We can't process file, return false
 	return false;
   }
-  string s;
-  while (getline(infile, s)) { //Get Street Name
-	string name = s;
-	getline(infile, s); //Get Number Of Street Segments
-	int num_attr = stoi(s);
-	for (int i = 0; i < num_attr; i++) {
-	  getline(infile, s); //Get Line Containing Two GeoCoords
-	  std::pair<GeoCoord, GeoCoord> cur = get_geocoords(s); //Parse Line Into Pair of GeoCoords
-	  if (map.find(cur.first) == nullptr) { //If we haven't recorded GeoCoord yet, init vector
-		vector<StreetSegment> vec;
-		map.associate(cur.first, vec);
-	  }
-	  map.find(cur.first)->push_back({cur.first, cur.second, name}); //Add other GeoCoord to vector
-	  if (map.find(cur.second) == nullptr) { //If we haven't recorded GeoCoord yet, init vector
-		vector<StreetSegment> vec;
-		map.associate(cur.second, vec);
-	  }
-	  map.find(cur.second)->push_back({cur.second, cur.first, name}); //Add other GeoCoord to vector
+  string text((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+  auto nextLine = [&text](size_t pos) {
+	size_t nl = text.find('\n', pos);
+	return nl == string::npos ? text.size() : nl + 1;
+  };
+  auto line = [&text](size_t pos, size_t next) { //The line starting at pos without its newline, like getline. A view, so parsing doesn't allocate
+	return string_view(text).substr(pos, next - pos - (next > pos && text[next - 1] == '\n' ? 1 : 0));
+  };
+
+  vector<StreetRecord> records; //Only the count lines are parsed here, which is cheap next to parsing coordinates
+  vector<size_t> first_segment{0}; //Slot of each record's first segment
+  for (size_t pos = 0; pos < text.size();) {
+	size_t count_line = nextLine(pos); //Skip Street Name
+	if (count_line >= text.size()) {
+	  break;
+	}
+	size_t next = nextLine(count_line);
+	int num_attr = stoi(string(line(count_line, next))); //Get Number Of Street Segments
+	records.push_back({pos, num_attr});
+	first_segment.push_back(first_segment.back() + num_attr);
+	for (pos = next; num_attr > 0; num_attr--) {
+	  pos = nextLine(pos);
 	}
   }
+
+  vector<string> names(records.size());
+  vector<PendingSegment> segments(first_segment.back());
+  parallelFor(records.size(), [&](size_t begin, size_t end) {
+	for (size_t r = begin; r < end; r++) {
+	  size_t pos = records[r].begin;
+	  size_t next = nextLine(pos);
+	  names[r] = string(line(pos, next)); //Get Street Name
+	  pos = nextLine(next);
+	  for (int i = 0; i < records[r].num_segments; i++) {
+		next = nextLine(pos);
+		std::pair<GeoCoord, GeoCoord> cur = get_geocoords(line(pos, next)); //Parse Line Into Pair of GeoCoords
+		segments[first_segment[r] + i] = {cur.first, cur.second, (int) r, true};
+		pos = next;
+	  }
+	}
+  }, 64);
+
+  StreetGraphBuilder builder; //Build without holding the lock, readers keep using the old map in the meantime
+  builder.addSegments(names, segments);
+  shared_ptr<const StreetGraph> g = builder.build();
+
+  lock_guard<mutex> lock(writer);
+  file_graph = g;
+  g = applyAdditions(*overlay); //Edits made before the reload still apply
+  publish(g, computeMetric(*g), overlay);
   return true;
 }
 
 bool StreetMapImpl::getSegmentsThatStartWith(const GeoCoord &gc, vector<StreetSegment> &segs) const {
-  auto v = map.find(gc);
-  if (v == nullptr) { //If map returns nullptr, we can't locate the GeoCoord and segs is unchanged
+  shared_ptr<const MapSnapshot> snap = snapshot();
+  int v = snap == nullptr ? -1 : snap->graph->nodeOf(gc);
+  if (v < 0) { //If we can't locate the GeoCoord, segs is unchanged
 	return false;
+  }
+  segs.clear();
+  for (int e = snap->graph->first_edge[v]; e < snap->graph->first_edge[v + 1]; e++) {
+	if (snap->metric->weight[e] != EdgeMetric::closed()) {
+	  segs.push_back(snap->graph->segment(e));
+	}
+  }
+  return true;
+}
+
+void StreetMapImpl::setEdgeWeights(const function<double(const StreetSegment &, double)> &weightOf) {
+  MemoryScope scope(MEM_STREET_MAP);
+  lock_guard<mutex> lock(writer);
+  weight_fn = weightOf;
+  shared_ptr<const MapSnapshot> snap = snapshot();
+  if (snap != nullptr) { //Same graph, only the weights change
+	publish(snap->graph, computeMetric(*snap->graph), overlay);
+  }
+}
+
+void StreetMapImpl::resetEdgeWeights() {
+  setEdgeWeights(nullptr);
+}
+
+bool StreetMapImpl::closeSegment(const GeoCoord &start, const GeoCoord &end) {
+  MemoryScope scope(MEM_STREET_MAP);
+  lock_guard<mutex> lock(writer);
+  shared_ptr<const MapSnapshot> snap = snapshot();
+  int v = snap == nullptr ? -1 : snap->graph->nodeOf(start);
+  if (v < 0) {
+	return false;
+  }
+  bool found = false;
+  for (int e = snap->graph->first_edge[v]; e < snap->graph->first_edge[v + 1]; e++) {
+	found = found || snap->graph->coords[snap->graph->edge_head[e]] == end;
+  }
+  if (!found) {
+	return false;
+  }
+  auto ov = make_shared<MapOverlay>(*overlay);
+  ov->closed.emplace_back(start, end);
+  publish(snap->graph, raw_metric, ov);
+  return true;
+}
+
+void StreetMapImpl::reopenSegment(const GeoCoord &start, const GeoCoord &end) {
+  MemoryScope scope(MEM_STREET_MAP);
+  lock_guard<mutex> lock(writer);
+  auto ov = make_shared<MapOverlay>(*overlay);
+  ov->closed.erase(remove_if(ov->closed.begin(), ov->closed.end(), [&](const pair<GeoCoord, GeoCoord> &c) {
+	return (c.first == start && c.second == end) || (c.first == end && c.second == start);
+  }), ov->closed.end());
+  shared_ptr<const MapSnapshot> snap = snapshot();
+  if (snap != nullptr) {
+	publish(snap->graph, raw_metric, ov);
   } else {
-	segs = *v; //We already have associated the GeoCoord with a vector of StreetSegs so just de-reference pointer and modify segs
-	return true;
+	overlay = ov;
+  }
+}
+
+void StreetMapImpl::addSegment(const StreetSegment &seg) {
+  MemoryScope scope(MEM_STREET_MAP);
+  lock_guard<mutex> lock(writer);
+  auto ov = make_shared<MapOverlay>(*overlay);
+  ov->added.push_back(seg);
+  shared_ptr<const StreetGraph> g = applyAdditions(*ov); //New segments change the graph itself, so rebuild it off to the side
+  publish(g, computeMetric(*g), ov);
+}
+
+void StreetMapImpl::clearOverlay() {
+  MemoryScope scope(MEM_STREET_MAP);
+  lock_guard<mutex> lock(writer);
+  auto ov = make_shared<MapOverlay>();
+  if (file_graph != nullptr) {
+	publish(file_graph, computeMetric(*file_graph), ov);
+  } else { //Nothing loaded, only the added segments were routable
+	overlay = ov;
+	atomic_store(&current, shared_ptr<const MapSnapshot>());
+  }
+}
+
+shared_ptr<const MapSnapshot> StreetMapImpl::snapshot() const {
+  return atomic_load(&current);
+}
+
+//Returns the map file's graph with the overlay's added segments merged in
+shared_ptr<const StreetGraph> StreetMapImpl::applyAdditions(const MapOverlay &ov) const {
+  if (ov.added.empty() && file_graph != nullptr) {
+	return file_graph;
+  }
+  StreetGraphBuilder builder;
+  if (file_graph != nullptr) {
+	for (const auto &name : file_graph->names) {
+	  builder.addName(name);
+	}
+	for (int e = 0; e < file_graph->numEdges(); e++) { //The file's edges one direction at a time, the reverse edge is its own entry
+	  builder.addSegment(file_graph->coords[file_graph->edge_tail[e]], file_graph->coords[file_graph->edge_head[e]], file_graph->edge_name[e], false);
+	}
+  }
+  for (const auto &seg : ov.added) {
+	builder.addSegment(seg.start, seg.end, builder.addName(seg.name), true);
   }
+  return builder.build();
 }
 
-std::pair<GeoCoord, GeoCoord> StreetMapImpl::get_geocoords(string s) {
-  int pos = 0;
+shared_ptr<const EdgeMetric> StreetMapImpl::computeMetric(const StreetGraph &g) const {
+  auto m = make_shared<EdgeMetric>();
+  if (!weight_fn) { //Route on length
+	m->weight = g.edge_length;
+	deriveFromWeights(g, *m);
+	return m;
+  }
+  m->weight.resize(g.numEdges());
+  double scale = EdgeMetric::closed();
+  for (int e = 0; e < g.numEdges(); e++) {
+	double len = g.edge_length[e];
+	double w = max(0.0, weight_fn(g.segment(e), len)); //Negative costs would break A*
+	m->weight[e] = w;
+	if (len > 0 && w != EdgeMetric::closed()) {
+	  scale = min(scale, w / len);
+	}
+  }
+  m->heuristic_scale = scale == EdgeMetric::closed() ? 0 : scale;
+  deriveFromWeights(g, *m);
+  return m;
+}
+
+//Applies the overlay's closures to raw and swaps in a new snapshot. Requests that already pinned the old one keep using it.
+void StreetMapImpl::publish(shared_ptr<const StreetGraph> g, shared_ptr<const EdgeMetric> raw, shared_ptr<const MapOverlay> ov) {
+  shared_ptr<const EdgeMetric> m = raw;
+  if (!ov->closed.empty()) {
+	auto closed = make_shared<EdgeMetric>(*raw);
+	for (const auto &c : ov->closed) {
+	  int a = g->nodeOf(c.first);
+	  int b = g->nodeOf(c.second);
+	  for (int e = a < 0 ? 0 : g->first_edge[a]; a >= 0 && e < g->first_edge[a + 1]; e++) {
+		if (g->edge_head[e] == b) {
+		  closed->weight[e] = EdgeMetric::closed();
+		}
+	  }
+	  for (int e = b < 0 ? 0 : g->first_edge[b]; b >= 0 && e < g->first_edge[b + 1]; e++) {
+		if (g->edge_head[e] == a) {
+		  closed->weight[e] = EdgeMetric::closed();
+		}
+	  }
+	}
+	deriveFromWeights(*g, *closed);
+	m = closed;
+  }
+  auto snap = make_shared<MapSnapshot>();
+  snap->version = ++version;
+  snap->graph = g;
+  snap->metric = m;
+  snap->overlay = ov;
+  raw_metric = raw;
+  overlay = ov;
+  atomic_store(&current, shared_ptr<const MapSnapshot>(snap));
+}
+
+std::pair<GeoCoord, GeoCoord> StreetMapImpl::get_geocoords(string_view s) const {
+  size_t pos = 0;
 
   pos = s.find(' '); //Finds position of first space indicating the end of the first coord
-  string l1 = s.substr(0, pos); //Gets the first coordinate
-  s.erase(0, pos + 1); //Erases first coordinate (so 3 remain)
+  string l1(s.substr(0, pos)); //Gets the first coordinate
+  s.remove_prefix(pos + 1); //Drops first coordinate (so 3 remain)
 
   pos = s.find(' ');
-  string l2 = s.substr(0, pos);
-  s.erase(0, pos + 1);
+  string l2(s.substr(0, pos));
+  s.remove_prefix(pos + 1);
 
   pos = s.find(' ');
-  string r1 = s.substr(0, pos);
-  s.erase(0, pos + 1);
+  string r1(s.substr(0, pos));
+  s.remove_prefix(pos + 1);
 
-  string r2 = s;
+  string r2(s);
 
   return {{l1, l2}, {r1, r2}}; //Create and a pair of GeoCoords based on the 4 coordinates (long/lat) we found
 }
 
+//provided.h gives StreetMap no way to reach its implementation from outside, so every StreetMap registers its impl
+//here for the functions in RouterApi.h to find
+static shared_mutex impls_mutex;
+static unordered_map<const StreetMap *, StreetMapImpl *> impls;
+
+static StreetMapImpl *implOf(const StreetMap &sm) {
+  shared_lock<shared_mutex> lock(impls_mutex);
+  return impls.at(&sm);
+}
+
 //******************** StreetMap functions ************************************
 
 // These functions simply delegate to StreetMapImpl's functions.
@@ -94,9 +689,15 @@ std::pair<GeoCoord, GeoCoord> StreetMapImpl::get_geocoords(string s) {
 
 StreetMap::StreetMap() {
   m_impl = new StreetMapImpl;
+  lock_guard<shared_mutex> lock(impls_mutex);
+  impls[this] = m_impl;
 }
 
 StreetMap::~StreetMap() {
+  {
+	lock_guard<shared_mutex> lock(impls_mutex);
+	impls.erase(this);
+  }
   delete m_impl;
 }
 
@@ -107,3 +708,33 @@ bool StreetMap::load(string mapFile) {
 bool StreetMap::getSegmentsThatStartWith(const GeoCoord &gc, vector<StreetSegment> &segs) const {
   return m_impl->getSegmentsThatStartWith(gc, segs);
 }
+
+//******************** RouterApi.h map functions ******************************
+
+void setEdgeWeights(StreetMap &sm, const function<double(const StreetSegment &, double)> &weightOf) {
+  implOf(sm)->setEdgeWeights(weightOf);
+}
+
+void resetEdgeWeights(StreetMap &sm) {
+  implOf(sm)->resetEdgeWeights();
+}
+
+bool closeSegment(StreetMap &sm, const GeoCoord &start, const GeoCoord &end) {
+  return implOf(sm)->closeSegment(start, end);
+}
+
+void reopenSegment(StreetMap &sm, const GeoCoord &start, const GeoCoord &end) {
+  implOf(sm)->reopenSegment(start, end);
+}
+
+void addSegment(StreetMap &sm, const StreetSegment &seg) {
+  implOf(sm)->addSegment(seg);
+}
+
+void clearOverlay(StreetMap &sm) {
+  implOf(sm)->clearOverlay();
+}
+
+shared_ptr<const MapSnapshot> mapSnapshot(const StreetMap &sm) {
+  return implOf(sm)->snapshot();
+}
@@ -1,4 +1,13 @@
 #include "provided.h"
+#include "RouterApi.h"
+#include "RouteEncoding.h"
+#include "StreetGraph.h"
+#include "MemoryAccounting.h"
+#include "LoadReplay.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <random>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -6,39 +15,159 @@
 #include <vector>
 using namespace std;
 
-bool loadDeliveryRequests(string deliveriesFile, GeoCoord& depot, vector<DeliveryRequest>& v);
-bool parseDelivery(string line, string& lat, string& lon, string& item);
+bool loadDeliveryRequests(string deliveriesFile, GeoCoord& depot, vector<DeliveryRequest>& v, vector<StopSchedule>& schedules);
+bool parseDelivery(string line, string& lat, string& lon, string& item, StopSchedule& schedule);
+void benchmarkRouter(const StreetMap& sm, int queries);
+void reportServiceArea(const StreetMap& sm, const GeoCoord& depot, double miles);
+bool checkOptimalOrders(StreetMap& sm, int count);
 
 int main(int argc, char *argv[])
 {
-    /*if (argc != 3)
+    string mapFile = "data/mapdata.txt";
+    string deliveriesFile = "data/deliveries.txt";
+    bool printPolylines = false;
+    string binaryFile;
+    PlanOptions options;
+    int benchQueries = 0;
+    double serviceAreaMiles = 0;
+    bool memoryReport = false;
+    string replayFile;
+    ReplayOptions replay;
+    string synthesizeFile;
+    int synthesizeCount = 0;
+    int checkCount = 0;
+    vector<string> files;
+    for (int i = 1; i < argc; i++)
     {
-        cout << "Usage: " << argv[0] << " mapdata.txt deliveries.txt" << endl;
+        string arg = argv[i];
+        if (arg == "--polyline")
+            printPolylines = true;
+        else if (arg == "--binary"  &&  i + 1 < argc)
+            binaryFile = argv[++i];
+        else if (arg == "--time-budget"  &&  i + 1 < argc)
+            options.timeBudgetSeconds = stod(argv[++i]);
+        else if (arg == "--speed"  &&  i + 1 < argc)
+            options.milesPerHour = stod(argv[++i]);
+        else if (arg == "--bench-router"  &&  i + 1 < argc)
+            benchQueries = stoi(argv[++i]);
+        else if (arg == "--isochrone"  &&  i + 1 < argc)
+            serviceAreaMiles = stod(argv[++i]);
+        else if (arg == "--mem-report")
+            memoryReport = true;
+        else if (arg == "--replay"  &&  i + 1 < argc)
+            replayFile = argv[++i];
+        else if (arg == "--concurrency"  &&  i + 1 < argc)
+            replay.concurrency = stoi(argv[++i]);
+        else if (arg == "--rate"  &&  i + 1 < argc)
+            replay.arrivalsPerSecond = stod(argv[++i]);
+        else if (arg == "--passes"  &&  i + 1 < argc)
+            replay.passes = stoi(argv[++i]);
+        else if (arg == "--synthesize"  &&  i + 2 < argc)
+        {
+            synthesizeFile = argv[++i];
+            synthesizeCount = stoi(argv[++i]);
+        }
+        else if (arg == "--check-orders"  &&  i + 1 < argc)
+            checkCount = stoi(argv[++i]);
+        else
+            files.push_back(arg);
+    }
+    if (files.size() == 2)
+    {
+        mapFile = files[0];
+        deliveriesFile = files[1];
+    }
+    else if (!files.empty())
+    {
+        cout << "Usage: " << argv[0] << " [mapdata.txt deliveries.txt] [--polyline] [--binary routes.bin] [--time-budget seconds] [--speed mph] [--bench-router queries] [--isochrone miles] [--mem-report] [--synthesize manifests.jsonl count] [--check-orders count] [--replay manifests.jsonl [--concurrency n] [--rate plans-per-second] [--passes n]]" << endl;
         return 1;
-    }*/
+    }
+
+    if (memoryReport  &&  !memoryAccountingEnabled())
+    {
+        cout << "--mem-report needs a build with -DMEMORY_ACCOUNTING" << endl;
+        return 1;
+    }
 
     StreetMap sm;
         
-    if (!sm.load("data/mapdata.txt"))
+    if (!sm.load(mapFile))
     {
-        cout << "Unable to load map data file " << argv[1] << endl;
+        cout << "Unable to load map data file " << mapFile << endl;
         return 1;
     }
 
+    if (memoryReport)
+    {
+        cout << "Memory after loading the map (bytes):\n";
+        reportMemoryUsage(cout);
+        cout << endl;
+        resetPeakMemory();
+    }
+
+    if (benchQueries > 0)
+    {
+        benchmarkRouter(sm, benchQueries);
+        if (memoryReport)
+        {
+            cout << "\nMemory while routing (bytes, peak is the largest query):\n";
+            reportMemoryUsage(cout);
+        }
+        return 0;
+    }
+
+    if (synthesizeCount > 0)
+    {
+        ofstream out(synthesizeFile);
+        if (!out)
+        {
+            cout << "Unable to write manifest file " << synthesizeFile << endl;
+            return 1;
+        }
+        for (const auto& m : synthesizeManifests(sm, synthesizeCount, 1))
+            writeManifest(out, m);
+        return 0;
+    }
+
+    if (checkCount > 0)
+        return checkOptimalOrders(sm, checkCount) ? 0 : 1;
+
+    if (!replayFile.empty())
+    {
+        vector<ReplayManifest> manifests;
+        string error;
+        if (!loadManifests(replayFile, manifests, error))
+        {
+            cout << error << endl;
+            return 1;
+        }
+        replay.plan = options;
+        replayManifests(sm, manifests, replay, cout);
+        return 0;
+    }
+
     GeoCoord depot;
     vector<DeliveryRequest> deliveries;
-    if (!loadDeliveryRequests("data/deliveries.txt", depot, deliveries))
+    vector<StopSchedule> schedules;
+    if (!loadDeliveryRequests(deliveriesFile, depot, deliveries, schedules))
     {
-        cout << "Unable to load delivery request file " << argv[2] << endl;
+        cout << "Unable to load delivery request file " << deliveriesFile << endl;
         return 1;
     }
 
+    if (serviceAreaMiles > 0)
+    {
+        reportServiceArea(sm, depot, serviceAreaMiles);
+        return 0;
+    }
+
     cout << "Generating route...\n\n";
 
-    DeliveryPlanner dp(&sm);
     vector<DeliveryCommand> dcs;
+    vector<list<StreetSegment>> legs;
+    vector<size_t> unreachable;
     double totalMiles;
-    DeliveryResult result = dp.generateDeliveryPlan(depot, deliveries, dcs, totalMiles);
+    DeliveryResult result = generateDeliveryPlan(sm, depot, deliveries, schedules, dcs, totalMiles, legs, unreachable, options);
     if (result == BAD_COORD)
     {
         cout << "One or more depot or delivery coordinates are invalid." << endl;
@@ -47,6 +176,8 @@ int main(int argc, char *argv[])
     if (result == NO_ROUTE)
     {
         cout << "No route can be found to deliver all items." << endl;
+        for (size_t i : unreachable)
+            cout << "Unreachable: " << deliveries[i].item << endl;
         return 1;
     }
     cout << "Starting at the depot...\n";
@@ -56,9 +187,31 @@ int main(int argc, char *argv[])
     cout.setf(ios::fixed);
     cout.precision(2);
     cout << totalMiles << " miles travelled for all deliveries." << endl;
+
+    if (memoryReport)
+    {
+        cout << "\nMemory while planning (bytes):\n";
+        reportMemoryUsage(cout);
+    }
+
+    if (printPolylines)
+    {
+        cout << "\nRoute geometry (one encoded polyline per leg):\n";
+        RouteEncoder(cout, RouteEncoder::POLYLINE).writeLegs(legs);
+    }
+    if (!binaryFile.empty())
+    {
+        ofstream out(binaryFile, ios::binary);
+        if (!out)
+        {
+            cout << "Unable to write route file " << binaryFile << endl;
+            return 1;
+        }
+        RouteEncoder(out, RouteEncoder::BINARY).writeLegs(legs);
+    }
 }
 
-bool loadDeliveryRequests(string deliveriesFile, GeoCoord& depot, vector<DeliveryRequest>& v)
+bool loadDeliveryRequests(string deliveriesFile, GeoCoord& depot, vector<DeliveryRequest>& v, vector<StopSchedule>& schedules)
 {
     ifstream inf(deliveriesFile);
     if (!inf)
@@ -72,13 +225,20 @@ bool loadDeliveryRequests(string deliveriesFile, GeoCoord& depot, vector<Deliver
     while (getline(inf, line))
     {
         string item;
-        if (parseDelivery(line, lat, lon, item))
+        StopSchedule schedule;
+        if (parseDelivery(line, lat, lon, item, schedule))
+        {
             v.push_back(DeliveryRequest(item, GeoCoord(lat, lon)));
+            schedules.push_back(schedule);
+        }
     }
     return true;
 }
 
-bool parseDelivery(string line, string& lat, string& lon, string& item)
+  // A delivery line is "lat lon:item", optionally with a time window and a
+  // service time in minutes before the colon: "lat lon start end [service]:item".
+  // A window needs both ends, and must not end before it starts.
+bool parseDelivery(string line, string& lat, string& lon, string& item, StopSchedule& schedule)
 {
     const size_t colon = line.find(':');
     if (colon == string::npos)
@@ -87,11 +247,29 @@ bool parseDelivery(string line, string& lat, string& lon, string& item)
         return false;
     }
     istringstream iss(line.substr(0, colon));
-    if (!(iss >> lat >> lon))
+    bool wellFormed = static_cast<bool>(iss >> lat >> lon);
+    vector<double> numbers;  // window start, window end, service minutes
+    string token;
+    while (wellFormed  &&  iss >> token)
+    {
+        char* rest;
+        numbers.push_back(strtod(token.c_str(), &rest));
+        wellFormed = *rest == '\0';
+    }
+    if (numbers.size() == 1  ||  numbers.size() > 3  ||  (numbers.size() >= 2  &&  !(numbers[1] >= numbers[0])))
+        wellFormed = false;
+    if (!wellFormed)
     {
         cout << "Bad format in deliveries file line: " << line << endl;
         return false;
     }
+    if (numbers.size() >= 2)
+    {
+        schedule.windowStart = numbers[0];
+        schedule.windowEnd = numbers[1];
+    }
+    if (numbers.size() == 3)
+        schedule.serviceMinutes = numbers[2];
     item = line.substr(colon + 1);
     if (item.empty())
     {
@@ -100,3 +278,146 @@ bool parseDelivery(string line, string& lat, string& lon, string& item)
     }
     return true;
 }
+
+  // Time point-to-point queries between random intersections (the same ones on
+  // every run) so router changes can be compared.
+void benchmarkRouter(const StreetMap& sm, int queries)
+{
+    shared_ptr<const MapSnapshot> snap = mapSnapshot(sm);
+    const StreetGraph& graph = *snap->graph;
+    mt19937 gen(42);
+    uniform_int_distribution<int> pick(0, graph.numNodes() - 1);
+    int routed = 0;
+    double miles = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < queries; i++)
+    {
+        const GeoCoord& from = graph.coords[pick(gen)];
+        const GeoCoord& to = graph.coords[pick(gen)];
+        list<StreetSegment> route;
+        double dist;
+        if (generatePointToPointRoute(*snap, from, to, route, dist) == DELIVERY_SUCCESS)
+        {
+            routed++;
+            miles += dist;
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout.setf(ios::fixed);
+    cout.precision(3);
+    cout << graph.numNodes() << " nodes, " << graph.numEdges() << " edges" << endl;
+    cout << queries << " queries, " << routed << " routed, " << miles << " miles in total" << endl;
+    cout << seconds * 1000 / queries << " ms per query" << endl;
+}
+
+  // Count the intersections within the given road distance of the depot.  The
+  // first query pays for preprocessing the map, so it is timed separately.
+void reportServiceArea(const StreetMap& sm, const GeoCoord& depot, double miles)
+{
+    OneToAllRouter router(&sm);
+    vector<GeoCoord> zone;
+    auto start = chrono::steady_clock::now();
+    if (router.isochrone(depot, miles, zone) != DELIVERY_SUCCESS)
+    {
+        cout << "The depot is not on the map." << endl;
+        return;
+    }
+    auto preprocessed = chrono::steady_clock::now();
+    router.isochrone(depot, miles, zone);
+    auto done = chrono::steady_clock::now();
+    cout.setf(ios::fixed);
+    cout.precision(3);
+    cout << zone.size() << " of " << mapSnapshot(sm)->graph->numNodes() << " intersections are within "
+         << miles << " miles of the depot" << endl;
+    cout << "First query " << chrono::duration<double>(preprocessed - start).count() * 1000 << " ms (includes preprocessing), "
+         << "then " << chrono::duration<double>(done - preprocessed).count() * 1000 << " ms per query" << endl;
+}
+
+  // Road distance of the route between two points, or infinity if there is
+  // none.
+double legLength(const MapSnapshot& snap, const GeoCoord& from, const GeoCoord& to)
+{
+    list<StreetSegment> route;
+    double dist;
+    if (generatePointToPointRoute(snap, from, to, route, dist) != DELIVERY_SUCCESS)
+        return numeric_limits<double>::infinity();
+    return dist;
+}
+
+  // Plan synthesized manifests of at most 8 stops and compare each planned
+  // order with the shortest one on the road, found by trying every order.
+  // Runs once on the map's own weights and once with northbound segments
+  // costing more, so routes differ by direction.  Returns false if any
+  // planned order is longer or its reported distance isn't its road length.
+bool checkOptimalOrders(StreetMap& sm, int count)
+{
+    const size_t maxStops = 8;
+    int checked = 0;
+    int failed = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (pass == 1)
+            setEdgeWeights(sm, [](const StreetSegment& s, double miles) {
+                return s.end.latitude > s.start.latitude ? 1.5 * miles : miles;
+            });
+        shared_ptr<const MapSnapshot> snap = mapSnapshot(sm);
+        for (auto& m : synthesizeManifests(sm, count, pass + 1))
+        {
+            if (m.deliveries.size() > maxStops)
+                m.deliveries.erase(m.deliveries.begin() + maxStops, m.deliveries.end());
+            vector<GeoCoord> stops;
+            for (const auto& d : m.deliveries)
+                stops.push_back(d.location);
+
+              // Every leg between two points, routed once
+            vector<GeoCoord> points = stops;
+            points.push_back(m.depot);
+            size_t n = points.size();
+            vector<double> leg(n * n, 0);
+            for (size_t a = 0; a < n; a++)
+                for (size_t b = 0; b < n; b++)
+                    if (a != b)
+                        leg[a * n + b] = legLength(*snap, points[a], points[b]);
+            vector<size_t> order;
+            for (size_t i = 0; i < stops.size(); i++)
+                order.push_back(i);
+            double best = numeric_limits<double>::infinity();
+            do
+            {
+                double total = 0;
+                size_t last = n - 1;
+                for (size_t i : order)
+                {
+                    total += leg[last * n + i];
+                    last = i;
+                }
+                best = min(best, total + leg[last * n + n - 1]);
+            } while (next_permutation(order.begin(), order.end()));
+
+            vector<DeliveryRequest> planned = m.deliveries;
+            vector<StopSchedule> schedules;
+            double oldMiles;
+            double newMiles;
+            bool exact;
+            optimizeDeliveryOrder(*snap, m.depot, planned, schedules, oldMiles, newMiles, exact);
+            double length = 0;
+            const GeoCoord* last = &m.depot;
+            for (const auto& d : planned)
+            {
+                length += legLength(*snap, *last, d.location);
+                last = &d.location;
+            }
+            length += legLength(*snap, *last, m.depot);
+            checked++;
+            if (length > best + 1e-9  ||  abs(newMiles - length) > 1e-9  ||  !exact)
+            {
+                failed++;
+                cout << "Manifest " << checked << " (" << stops.size() << " stops): planned "
+                     << length << " miles, reported " << newMiles << ", best " << best << endl;
+            }
+        }
+    }
+    resetEdgeWeights(sm);
+    cout << checked << " orders checked, " << failed << " not the shortest on the road" << endl;
+    return failed == 0;
+}